@@ -1,38 +1,435 @@
 #include "file.hpp"
+#include "io_util.hpp"
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <dirent.h>
+#include <zstd.h>
+#include <list>
+#include <mutex>
 
 namespace cses {
 
-FileSave::FileSave() : saveCalled(false) {
-	tmpfile.exceptions(std::ofstream::eofbit | std::ofstream::failbit | std::ofstream::badbit);
-	if(!SHA1_Init(&shaCtx)) {
-		throw Error("FileSave::FileSave: SHA1_Init failed.");
+namespace {
+
+string encodeHash(const uint8_t* rawHash) {
+	string hash;
+	const char* enc = "0123456789abcdef";
+	for(size_t i = 0; i < SHA_DIGEST_LENGTH; ++i) {
+		uint8_t byte = rawHash[i];
+		hash.push_back(enc[byte >> 4]);
+		hash.push_back(enc[byte & 15]);
+	}
+	return hash;
+}
+
+// Create directory unless it already exists. Returns whether it was created.
+bool makeDirectory(const string& path) {
+	if(mkdir(path.c_str(), 0700) == 0) return true;
+	if(errno != EEXIST) {
+		throw Error("makeDirectory: Could not create directory " + path + ".");
+	}
+	return false;
+}
+
+// Make entries created in the directory durable.
+void syncDirectory(const string& path) {
+	int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+	if(fd == -1) throw Error("syncDirectory: Could not open directory " + path + ".");
+	int res = fsync(fd);
+	close(fd);
+	if(res == -1) throw Error("syncDirectory: fsync failed for " + path + ".");
+}
+
+// Directory of the file in the store, sharded by the first two bytes of the
+// hash so that no directory grows too large.
+string storageDirectory(const string& hash) {
+	return "files/" + hash.substr(0, 2) + "/" + hash.substr(2, 2);
+}
+
+// Create the directory of the file in the store. New directories are made
+// durable in their parents, so that files moved to them survive a crash.
+string makeStorageDirectory(const string& hash) {
+	string outer = "files/" + hash.substr(0, 2);
+	string dir = storageDirectory(hash);
+	if(makeDirectory("files")) syncDirectory(".");
+	if(makeDirectory(outer)) syncDirectory("files");
+	if(makeDirectory(dir)) syncDirectory(outer);
+	return dir;
+}
+
+string compressedStoragePath(const string& hash) {
+	return getFileStoragePath(hash) + ".zst";
+}
+
+// Move file with durable contents to the store as path of the given hash.
+void moveToStore(const string& from, const string& hash, const string& path) {
+	string dir = makeStorageDirectory(hash);
+	if(rename(from.c_str(), path.c_str()) == -1) {
+		throw Error("moveToStore: Could not move " + from + " to the file store.");
+	}
+	syncDirectory(dir);
+}
+
+void writeAll(int fd, const char* data, size_t length) {
+	while(length != 0) {
+		ssize_t written = ::write(fd, data, length);
+		if(written == -1) {
+			if(errno == EINTR) continue;
+			throw Error("writeAll: write failed.");
+		}
+		data += written;
+		length -= written;
 	}
+}
+
+// Read up to length bytes from offset, less only at the end of file.
+size_t readAll(int fd, char* data, size_t length, int64_t offset) {
+	size_t total = 0;
+	while(total < length) {
+		ssize_t got = pread(fd, data + total, length - total, offset + total);
+		if(got == -1) {
+			if(errno == EINTR) continue;
+			throw Error("readAll: pread failed.");
+		}
+		if(got == 0) break;
+		total += got;
+	}
+	return total;
+}
+
+bool pathExists(const string& path) {
+	struct stat statBuf;
+	if(stat(path.c_str(), &statBuf) == -1) {
+		if(errno == ENOENT) return false;
+		throw Error("pathExists: stat returned error other than ENOENT.");
+	}
+	return true;
+}
+
+// Open the stored representation of the file, preferring the uncompressed
+// one. Throws Error if the file is not stored.
+int openStoredFile(const string& hash, bool& compressed) {
+	int fd = open(getFileStoragePath(hash).c_str(), O_RDONLY);
+	compressed = false;
+	if(fd == -1 && errno == ENOENT) {
+		fd = open(compressedStoragePath(hash).c_str(), O_RDONLY);
+		compressed = true;
+	}
+	if(fd == -1) throw Error("openStoredFile: Could not open file " + hash + ".");
+	return fd;
+}
+
+bool compressionEnabled = false;
+// Smaller files are not worth decompressing on every read.
+const int64_t MIN_COMPRESSED_SIZE = 4096;
+const int COMPRESSION_LEVEL = 3;
+
+// Temporary file in files/tmp that is moved to the store when complete.
+struct TempFile {
+	TempFile() {
+		makeDirectory("files");
+		makeDirectory("files/tmp");
+		
+#ifdef O_TMPFILE
+		// Unnamed temporary file is linked to the store only when complete,
+		// so that nothing is left behind by a crash.
+		fd = open("files/tmp", O_TMPFILE | O_RDWR, 0600);
+		if(fd != -1) return;
+#endif
+
+		char nameArray[] = "files/tmp/tmp_XXXXXX";
+		fd = mkstemp(nameArray);
+		if(fd == -1) throw Error("TempFile: Creating temporary file failed.");
+		name = nameArray;
+	}
+	~TempFile() {
+		if(fd != -1) close(fd);
+		if(!name.empty()) unlink(name.c_str());
+	}
+	TempFile(const TempFile&) = delete;
+	TempFile& operator=(const TempFile&) = delete;
 	
-	mkdir("files", 0700);
+	// Make the contents durable and store the file at path of the hash.
+	// An existing file at the path has the same contents.
+	void commit(const string& hash, const string& path) {
+		if(fsync(fd) == -1) throw Error("TempFile::commit: fsync failed.");
+		if(name.empty()) {
+			string dir = makeStorageDirectory(hash);
+			string procPath = "/proc/self/fd/" + std::to_string(fd);
+			if(linkat(AT_FDCWD, procPath.c_str(), AT_FDCWD, path.c_str(), AT_SYMLINK_FOLLOW) == -1) {
+				if(errno != EEXIST) throw Error("TempFile::commit: Could not link temporary file.");
+				// The file is saved again, so it must not look old to the
+				// garbage collector.
+				utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+			}
+			syncDirectory(dir);
+		} else {
+			moveToStore(name, hash, path);
+			name = "";
+		}
+		close(fd);
+		fd = -1;
+	}
 	
-	char tmpfilenameArray[] = "files/tmp_XXXXXX";
-	int fd = mkstemp(tmpfilenameArray);
-	if(fd == -1) throw Error("FileSave::FileSave: Creating temporary file failed.");
-	close(fd);
+	int fd;
+	// Empty if the file is unnamed.
+	string name;
+};
+
+// Streaming zstd decompression, feeding the decompressed data to a callback.
+class Decompressor {
+public:
+	Decompressor() : stream(ZSTD_createDStream()), finished(true) {
+		if(!stream) throw Error("Decompressor: ZSTD_createDStream failed.");
+		ZSTD_initDStream(stream);
+	}
+	~Decompressor() {
+		ZSTD_freeDStream(stream);
+	}
+	Decompressor(const Decompressor&) = delete;
+	Decompressor& operator=(const Decompressor&) = delete;
+	
+	template <typename Output>
+	void write(const char* data, size_t length, Output output) {
+		ZSTD_inBuffer input = {data, length, 0};
+		char buf[65536];
+		// Continue after the input is consumed while the output buffer fills
+		// up, as the stream may still hold decompressed data.
+		bool outputFull = true;
+		while(input.pos < input.size || outputFull) {
+			ZSTD_outBuffer out = {buf, sizeof(buf), 0};
+			size_t res = ZSTD_decompressStream(stream, &out, &input);
+			if(ZSTD_isError(res)) throw Error("Decompressor: Corrupted data.");
+			output(buf, out.pos);
+			finished = res == 0;
+			outputFull = out.pos == out.size;
+		}
+	}
+	
+	// Whether the data written so far ends at the end of a frame.
+	bool complete() const {
+		return finished;
+	}
+
+private:
+	ZSTD_DStream* stream;
+	bool finished;
+};
+
+// Decompressed size of stored compressed file from its frame header.
+int64_t compressedContentSize(int fd) {
+	char header[ZSTD_FRAMEHEADERSIZE_MAX];
+	size_t got = readAll(fd, header, sizeof(header), 0);
+	unsigned long long size = ZSTD_getFrameContentSize(header, got);
+	if(size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR) {
+		throw Error("compressedContentSize: Invalid frame header.");
+	}
+	return size;
+}
+
+// Compress size bytes of the file to a new temporary file. Returns nullptr if
+// the data does not shrink.
+unique_ptr<TempFile> compressFile(int fd, int64_t size) {
+	unique_ptr<TempFile> compressed(new TempFile);
+	unique_ptr<ZSTD_CCtx, size_t(*)(ZSTD_CCtx*)> ctx(ZSTD_createCCtx(), ZSTD_freeCCtx);
+	if(!ctx) throw Error("compressFile: ZSTD_createCCtx failed.");
+	ZSTD_CCtx_setParameter(ctx.get(), ZSTD_c_compressionLevel, COMPRESSION_LEVEL);
+	// Stores the size in the frame header for fileSizeByHash.
+	ZSTD_CCtx_setPledgedSrcSize(ctx.get(), size);
 	
-	tmpfilename = tmpfilenameArray;
-	tmpfile.open(tmpfilename, std::ios_base::out | std::ios_base::binary);
+	vector<char> inBuf(ZSTD_CStreamInSize());
+	vector<char> outBuf(ZSTD_CStreamOutSize());
+	int64_t offset = 0;
+	int64_t compressedSize = 0;
+	while(true) {
+		size_t got = readAll(fd, &inBuf[0], inBuf.size(), offset);
+		offset += got;
+		ZSTD_EndDirective mode = offset >= size ? ZSTD_e_end : ZSTD_e_continue;
+		if(got == 0 && mode != ZSTD_e_end) throw Error("compressFile: File ended unexpectedly.");
+		ZSTD_inBuffer input = {&inBuf[0], got, 0};
+		bool done = false;
+		while(!done) {
+			ZSTD_outBuffer output = {&outBuf[0], outBuf.size(), 0};
+			size_t remaining = ZSTD_compressStream2(ctx.get(), &output, &input, mode);
+			if(ZSTD_isError(remaining)) throw Error("compressFile: Compression failed.");
+			writeAll(compressed->fd, &outBuf[0], output.pos);
+			compressedSize += output.pos;
+			if(compressedSize >= size) return nullptr;
+			done = mode == ZSTD_e_end ? remaining == 0 : input.pos == input.size;
+		}
+		if(mode == ZSTD_e_end) break;
+	}
+	return compressed;
 }
 
-FileSave::~FileSave() {
-	if(tmpfilename != "") {
-		unlink(tmpfilename.c_str());
+// Stream buffer that decompresses stored compressed file. Owns the file
+// descriptor.
+class DecompressingBuffer: public std::streambuf {
+public:
+	DecompressingBuffer(int fd)
+		: fd(fd), offset(0), stream(ZSTD_createDStream()),
+		  inBuf(ZSTD_DStreamInSize()), outBuf(ZSTD_DStreamOutSize())
+	{
+		if(!stream) {
+			close(fd);
+			throw Error("DecompressingBuffer: ZSTD_createDStream failed.");
+		}
+		ZSTD_initDStream(stream);
+		input = {&inBuf[0], 0, 0};
+	}
+	~DecompressingBuffer() {
+		ZSTD_freeDStream(stream);
+		close(fd);
+	}
+
+protected:
+	int_type underflow() override {
+		while(true) {
+			if(input.pos == input.size) {
+				size_t got = readAll(fd, &inBuf[0], inBuf.size(), offset);
+				if(got == 0) return traits_type::eof();
+				offset += got;
+				input = {&inBuf[0], got, 0};
+			}
+			ZSTD_outBuffer output = {&outBuf[0], outBuf.size(), 0};
+			size_t res = ZSTD_decompressStream(stream, &output, &input);
+			if(ZSTD_isError(res)) throw Error("DecompressingBuffer: Corrupted data.");
+			if(output.pos != 0) {
+				setg(&outBuf[0], &outBuf[0], &outBuf[0] + output.pos);
+				return traits_type::to_int_type(outBuf[0]);
+			}
+		}
+	}
+
+private:
+	int fd;
+	int64_t offset;
+	ZSTD_DStream* stream;
+	vector<char> inBuf;
+	vector<char> outBuf;
+	ZSTD_inBuffer input;
+};
+
+class DecompressingStream: public std::istream {
+public:
+	DecompressingStream(int fd) : std::istream(nullptr), buffer(fd) {
+		rdbuf(&buffer);
+	}
+private:
+	DecompressingBuffer buffer;
+};
+
+// Decompressing stream of a file left where a chunked read ended.
+struct ChunkCursor {
+	string hash;
+	int64_t offset;
+	unique_ptr<DecompressingStream> in;
+};
+
+// Cursors of the latest chunked reads of compressed files, so that reading a
+// file chunk by chunk in order decompresses it only once.
+class ChunkCursors {
+public:
+	static ChunkCursors& instance() {
+		static ChunkCursors cursors;
+		return cursors;
+	}
+	
+	// Take a cursor of the file at or before offset, or nullptr if there is
+	// none.
+	unique_ptr<ChunkCursor> take(const string& hash, int64_t offset) {
+		std::lock_guard<std::mutex> lock(mutex);
+		for(auto it = cursors.begin(); it != cursors.end(); ++it) {
+			if((*it)->hash == hash && (*it)->offset <= offset) {
+				unique_ptr<ChunkCursor> cursor = move(*it);
+				cursors.erase(it);
+				return cursor;
+			}
+		}
+		return nullptr;
+	}
+	
+	void put(unique_ptr<ChunkCursor> cursor) {
+		std::lock_guard<std::mutex> lock(mutex);
+		cursors.push_front(move(cursor));
+		if(cursors.size() > MAX_CURSORS) cursors.pop_back();
+	}
+
+private:
+	// Each cursor keeps a file open and a decompression window in memory.
+	static const size_t MAX_CURSORS = 8;
+	
+	std::mutex mutex;
+	// Most recently used first.
+	std::list<unique_ptr<ChunkCursor>> cursors;
+};
+
+// Hash of the file contents, computed from the stored data.
+string hashStoredData(int fd, bool compressed) {
+	SHA_CTX shaCtx;
+	if(!SHA1_Init(&shaCtx)) {
+		throw Error("hashStoredData: SHA1_Init failed.");
+	}
+	auto update = [&](const char* data, size_t length) {
+		if(!SHA1_Update(&shaCtx, data, length)) {
+			throw Error("hashStoredData: SHA1_Update failed.");
+		}
+	};
+	
+	Decompressor decompressor;
+	const size_t BUFSIZE = 65536;
+	char buf[BUFSIZE];
+	int64_t offset = 0;
+	while(size_t got = readAll(fd, buf, BUFSIZE, offset)) {
+		offset += got;
+		if(compressed) {
+			decompressor.write(buf, got, update);
+		} else {
+			update(buf, got);
+		}
+	}
+	if(!decompressor.complete()) throw Error("hashStoredData: Compressed data is incomplete.");
+	
+	uint8_t rawHash[SHA_DIGEST_LENGTH];
+	if(!SHA1_Final(rawHash, &shaCtx)) {
+		throw Error("hashStoredData: SHA1_Final failed.");
+	}
+	return encodeHash(rawHash);
+}
+
+} // end anonymous namespace
+
+struct FileSave::Impl {
+	TempFile tmp;
+	Decompressor decompressor;
+};
+
+FileSave::FileSave(bool compressedInput)
+	: saveCalled(false), compressedInput(compressedInput), size(0), impl(new Impl)
+{
+	if(!SHA1_Init(&shaCtx)) {
+		throw Error("FileSave::FileSave: SHA1_Init failed.");
 	}
 }
 
+FileSave::~FileSave() { }
+
 void FileSave::write(const char* data, size_t length) {
-	if(!SHA1_Update(&shaCtx, data, length)) {
-		throw Error("FileSave::write: SHA1_Update failed");
+	auto update = [&](const char* data, size_t length) {
+		if(!SHA1_Update(&shaCtx, data, length)) {
+			throw Error("FileSave::write: SHA1_Update failed");
+		}
+		size += length;
+	};
+	if(compressedInput) {
+		impl->decompressor.write(data, length, update);
+	} else {
+		update(data, length);
 	}
-	tmpfile.write(data, length);
+	writeAll(impl->tmp.fd, data, length);
 }
 
 void FileSave::writeFileContents(const string& filename) {
@@ -48,7 +445,7 @@ void FileSave::writeStream(std::istream& in) {
 		throw Error("FileSave::writeStream: Stream not good().");
 	}
 	
-	const size_t BUFSIZE = 4096;
+	const size_t BUFSIZE = 65536;
 	
 	while(!in.eof()) {
 		char buf[BUFSIZE];
@@ -64,31 +461,36 @@ string FileSave::save() {
 	if(saveCalled) throw Error("FileSave::save: Called multiple times.");
 	saveCalled = true;
 	
-	tmpfile.close();
-	
 	uint8_t rawHash[SHA_DIGEST_LENGTH];
 	if(!SHA1_Final(rawHash, &shaCtx)) {
 		throw Error("FileSave::save: SHA1_Final failed");
 	}
 	
-	string hash;
-	const char* enc = "0123456789abcdef";
-	for(size_t i = 0; i < SHA_DIGEST_LENGTH; ++i) {
-		uint8_t byte = rawHash[i];
-		hash.push_back(enc[byte >> 4]);
-		hash.push_back(enc[byte & 15]);
-	}
+	string hash = encodeHash(rawHash);
 	
-	string filename = "files/" + hash;
-	if(rename(tmpfilename.c_str(), filename.c_str()) == -1) {
-		throw Error("FileSave::save: Could not move temporary file.");
-	} else {
-		tmpfilename = "";
+	if(compressedInput) {
+		if(!impl->decompressor.complete()) {
+			throw Error("FileSave::save: Compressed data is incomplete.");
+		}
+		impl->tmp.commit(hash, compressedStoragePath(hash));
+		return hash;
+	}
+	if(compressionEnabled && size >= MIN_COMPRESSED_SIZE) {
+		unique_ptr<TempFile> compressed = compressFile(impl->tmp.fd, size);
+		if(compressed) {
+			compressed->commit(hash, compressedStoragePath(hash));
+			return hash;
+		}
 	}
+	impl->tmp.commit(hash, getFileStoragePath(hash));
 	
 	return hash;
 }
 
+void setFileCompression(bool enabled) {
+	compressionEnabled = enabled;
+}
+
 string saveStringToFile(const string& data) {
 	FileSave saver;
 	saver.write(&data[0], data.size());
@@ -101,35 +503,47 @@ string saveStreamToFile(std::istream& in) {
 	return saver.save();
 }
 
-unique_ptr<std::ifstream> openFileByHash(const string& hash) {
-	unique_ptr<std::ifstream> ret(new std::ifstream);
-	
-	string filename = "files/" + hash;
-	ret->open(filename);
+unique_ptr<std::istream> openFileByHash(const string& hash) {
+	bool compressed;
+	int fd = openStoredFile(hash, compressed);
+	if(compressed) {
+		return unique_ptr<std::istream>(new DecompressingStream(fd));
+	}
+	close(fd);
 	
+	unique_ptr<std::ifstream> ret(new std::ifstream);
+	ret->open(getFileStoragePath(hash), std::ios_base::in | std::ios_base::binary);
 	if(!ret->good()) throw Error("openFileByHash: Could not open file.");
 	
-	return ret;
+	return unique_ptr<std::istream>(move(ret));
 }
 
 string getFileStoragePath(const string& hash) {
-	return "files/" + hash;
+	return storageDirectory(hash) + "/" + hash;
 }
 
-bool fileHashExists(const string& hash) {
-	string filename = "files/" + hash;
+string materializeFile(const string& hash) {
+	string path = getFileStoragePath(hash);
+	if(pathExists(path)) return path;
 	
-	struct stat statBuf;
-	int res = stat(filename.c_str(), &statBuf);
-	if(res == -1) {
-		if(errno == ENOENT) {
-			return false;
-		} else {
-			throw Error("fileHashExists: stat returned error other than ENOENT.");
-		}
-	}
+	int fd = open(compressedStoragePath(hash).c_str(), O_RDONLY);
+	if(fd == -1) throw Error("materializeFile: Could not open file " + hash + ".");
+	DecompressingStream in(fd);
 	
-	return true;
+	// The compressed file is kept for transfers.
+	TempFile tmp;
+	const size_t BUFSIZE = 65536;
+	char buf[BUFSIZE];
+	while(in.read(buf, BUFSIZE), in.gcount() != 0) {
+		writeAll(tmp.fd, buf, in.gcount());
+	}
+	if(in.bad()) throw Error("materializeFile: Reading compressed file failed.");
+	tmp.commit(hash, path);
+	return path;
+}
+
+bool fileHashExists(const string& hash) {
+	return pathExists(getFileStoragePath(hash)) || pathExists(compressedStoragePath(hash));
 }
 
 bool isValidFileHash(const string& str) {
@@ -143,6 +557,12 @@ bool isValidFileHash(const string& str) {
 	return true;
 }
 
+string hashString(const string& data) {
+	uint8_t rawHash[SHA_DIGEST_LENGTH];
+	SHA1((const unsigned char*)data.data(), data.size(), rawHash);
+	return encodeHash(rawHash);
+}
+
 string readFile(std::istream& in) {
 	in.exceptions(std::ifstream::eofbit | std::ifstream::failbit | std::ifstream::badbit);
 	in.seekg(0,std::ios::end);
@@ -154,9 +574,359 @@ string readFile(std::istream& in) {
 	return buffer;
 }
 
+struct FileView::Mapping {
+	Mapping(const char* data, size_t size) : data(data), size(size) { }
+	~Mapping() {
+		if(size != 0) munmap((void*)data, size);
+	}
+	Mapping(const Mapping&) = delete;
+	Mapping& operator=(const Mapping&) = delete;
+	
+	const char* data;
+	size_t size;
+};
+
+FileView::FileView() { }
+
+FileView::FileView(shared_ptr<const Mapping> mapping) : mapping(move(mapping)) { }
+
+const char* FileView::data() const {
+	return mapping ? mapping->data : nullptr;
+}
+
+size_t FileView::size() const {
+	return mapping ? mapping->size : 0;
+}
+
+string FileView::substr(size_t offset, size_t length) const {
+	if(offset >= size()) return string();
+	return string(data() + offset, std::min(length, size() - offset));
+}
+
+string FileView::str() const {
+	return string(data(), size());
+}
+
+FileView mapFileByHash(const string& hash) {
+	bool compressed;
+	int fd = openStoredFile(hash, compressed);
+	
+	size_t size;
+	try {
+		if(compressed) {
+			size = compressedContentSize(fd);
+		} else {
+			struct stat statBuf;
+			if(fstat(fd, &statBuf) == -1) throw Error("mapFileByHash: fstat failed.");
+			size = statBuf.st_size;
+		}
+	} catch(...) {
+		close(fd);
+		throw;
+	}
+	
+	// Empty files cannot be mapped.
+	if(size == 0) {
+		close(fd);
+		return FileView(std::make_shared<const FileView::Mapping>(nullptr, 0));
+	}
+	
+	void* mapped;
+	if(compressed) {
+		// Decompressed contents are kept in anonymous memory instead.
+		mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	} else {
+		mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	if(mapped == MAP_FAILED) {
+		close(fd);
+		throw Error("mapFileByHash: mmap failed.");
+	}
+	auto mapping = std::make_shared<const FileView::Mapping>((const char*)mapped, size);
+	
+	if(compressed) {
+		DecompressingStream in(fd);
+		in.read((char*)mapped, size);
+		if((size_t)in.gcount() != size) {
+			throw Error("mapFileByHash: Compressed file is shorter than its header says.");
+		}
+	} else {
+		close(fd);
+	}
+	
+	return FileView(mapping);
+}
+
+struct FileBlockReader::Impl {
+	Impl(int fd) : in(fd), buffer(BLOCK_SIZE) { }
+	
+	static const size_t BLOCK_SIZE = 1 << 16;
+	
+	DecompressingStream in;
+	vector<char> buffer;
+};
+
+FileBlockReader::FileBlockReader(const string& hash) : viewRead(false) {
+	bool compressed;
+	int fd = openStoredFile(hash, compressed);
+	if(compressed) {
+		impl.reset(new Impl(fd));
+	} else {
+		close(fd);
+		view = mapFileByHash(hash);
+	}
+}
+
+FileBlockReader::~FileBlockReader() { }
+
+bool FileBlockReader::next(const char*& data, size_t& size) {
+	if(!impl) {
+		if(viewRead || view.size() == 0) return false;
+		viewRead = true;
+		data = view.data();
+		size = view.size();
+		return true;
+	}
+	impl->in.read(&impl->buffer[0], impl->buffer.size());
+	if(impl->in.bad()) throw Error("FileBlockReader: Reading compressed file failed.");
+	if(impl->in.gcount() == 0) return false;
+	data = &impl->buffer[0];
+	size = impl->in.gcount();
+	return true;
+}
+
 string readFileByHash(const string& hash) {
-	unique_ptr<std::ifstream> inPtr = openFileByHash(hash);
-	return readFile(*inPtr);
+	return mapFileByHash(hash).str();
+}
+
+int64_t fileSizeByHash(const string& hash) {
+	bool compressed;
+	int fd = openStoredFile(hash, compressed);
+	int64_t size;
+	try {
+		if(compressed) {
+			size = compressedContentSize(fd);
+		} else {
+			struct stat statBuf;
+			if(fstat(fd, &statBuf) == -1) throw Error("fileSizeByHash: fstat failed.");
+			size = statBuf.st_size;
+		}
+	} catch(...) {
+		close(fd);
+		throw;
+	}
+	close(fd);
+	return size;
+}
+
+string readFileChunkByHash(const string& hash, int64_t offset, size_t length) {
+	bool compressed;
+	int fd = openStoredFile(hash, compressed);
+	if(!compressed) {
+		close(fd);
+		return mapFileByHash(hash).substr(offset, length);
+	}
+	
+	// Data before the offset has to be decompressed too, so the read is
+	// continued from where an earlier one ended if possible. Transfers of
+	// compressed files should still use readStoredFileChunk instead.
+	unique_ptr<ChunkCursor> cursor = ChunkCursors::instance().take(hash, offset);
+	if(cursor) {
+		close(fd);
+	} else {
+		cursor.reset(new ChunkCursor{hash, 0, unique_ptr<DecompressingStream>(new DecompressingStream(fd))});
+	}
+	std::istream& in = *cursor->in;
+	in.ignore(offset - cursor->offset);
+	string buffer(length, '\0');
+	in.read(&buffer[0], length);
+	if(in.bad()) throw Error("readFileChunkByHash: Reading file failed.");
+	buffer.resize(in.gcount());
+	cursor->offset = offset + buffer.size();
+	// The stream is at the end of the file if it returned less than asked.
+	if(buffer.size() == length) ChunkCursors::instance().put(move(cursor));
+	return buffer;
+}
+
+optional<int> readIntegerFileByHash(const string& hash) {
+	// The number is at the beginning, even if the file is large.
+	const size_t MAX_INTEGER_LENGTH = 64;
+	return stringToInteger<int>(readFileChunkByHash(hash, 0, MAX_INTEGER_LENGTH));
+}
+
+StoredFileInfo storedFileInfo(const string& hash) {
+	// Compressed representation is preferred for transfers.
+	StoredFileInfo info;
+	info.compressed = pathExists(compressedStoragePath(hash));
+	string path = info.compressed ? compressedStoragePath(hash) : getFileStoragePath(hash);
+	struct stat statBuf;
+	if(stat(path.c_str(), &statBuf) == -1) {
+		throw Error("storedFileInfo: Could not stat file " + hash + ".");
+	}
+	info.size = statBuf.st_size;
+	return info;
+}
+
+string readStoredFileChunk(const string& hash, bool compressed, int64_t offset, size_t length) {
+	string path = compressed ? compressedStoragePath(hash) : getFileStoragePath(hash);
+	int fd = open(path.c_str(), O_RDONLY);
+	if(fd == -1) throw Error("readStoredFileChunk: Could not open file " + hash + ".");
+	string buffer(length, '\0');
+	try {
+		buffer.resize(readAll(fd, &buffer[0], length, offset));
+	} catch(...) {
+		close(fd);
+		throw;
+	}
+	close(fd);
+	return buffer;
+}
+
+PartialFile::PartialFile(const string& hash)
+	: hash(hash), filename("files/partial/" + hash)
+{
+	makeDirectory("files");
+	makeDirectory("files/partial");
+}
+
+int64_t PartialFile::receivedBytes() {
+	struct stat statBuf;
+	if(stat(filename.c_str(), &statBuf) == -1) {
+		if(errno == ENOENT) return 0;
+		throw Error("PartialFile::receivedBytes: stat returned error other than ENOENT.");
+	}
+	return statBuf.st_size;
+}
+
+void PartialFile::append(int64_t offset, const char* data, size_t length) {
+	if(offset != receivedBytes()) {
+		throw Error("PartialFile::append: Offset does not match received data.");
+	}
+	
+	std::ofstream out;
+	out.exceptions(std::ofstream::eofbit | std::ofstream::failbit | std::ofstream::badbit);
+	out.open(filename, std::ios_base::out | std::ios_base::binary | std::ios_base::app);
+	out.write(data, length);
+}
+
+bool PartialFile::commit(bool compressed) {
+	int fd = open(filename.c_str(), O_RDONLY);
+	if(fd == -1) throw Error("PartialFile::commit: Opening partial file failed.");
+	
+	bool matches;
+	try {
+		matches = hashStoredData(fd, compressed) == hash;
+	} catch(const Error& e) {
+		// Corrupted compressed data.
+		cerr << "PartialFile::commit: " << e.what() << "\n";
+		matches = false;
+	}
+	if(!matches) {
+		close(fd);
+		unlink(filename.c_str());
+		return false;
+	}
+	
+	int res = fsync(fd);
+	close(fd);
+	if(res == -1) throw Error("PartialFile::commit: fsync failed.");
+	
+	moveToStore(filename, hash, compressed ? compressedStoragePath(hash) : getFileStoragePath(hash));
+	return true;
+}
+
+vector<StoredFileEntry> listStoredFiles() {
+	map<string, StoredFileEntry> entries;
+	auto listDirectory = [](const string& path) {
+		vector<string> names;
+		DIR* dir = opendir(path.c_str());
+		if(!dir) {
+			if(errno == ENOENT) return names;
+			throw Error("listStoredFiles: Could not open directory " + path + ".");
+		}
+		while(struct dirent* entry = readdir(dir)) {
+			string name = entry->d_name;
+			if(name != "." && name != "..") names.push_back(name);
+		}
+		closedir(dir);
+		return names;
+	};
+	for(const string& first : listDirectory("files")) {
+		if(first.size() != 2 || first.find_first_not_of("0123456789abcdef") != string::npos) continue;
+		for(const string& second : listDirectory("files/" + first)) {
+			string dir = "files/" + first + "/" + second;
+			for(const string& name : listDirectory(dir)) {
+				string hash = name.substr(0, 2 * SHA_DIGEST_LENGTH);
+				if(!isValidFileHash(hash)) continue;
+				if(name != hash && name != hash + ".zst") continue;
+				struct stat statBuf;
+				// The file may have been removed concurrently.
+				if(stat((dir + "/" + name).c_str(), &statBuf) == -1) continue;
+				StoredFileEntry& entry = entries[hash];
+				entry.hash = hash;
+				entry.bytes += statBuf.st_size;
+				entry.modified = std::max(entry.modified, statBuf.st_mtime);
+			}
+		}
+	}
+	vector<StoredFileEntry> ret;
+	for(const auto& entry : entries) {
+		ret.push_back(entry.second);
+	}
+	return ret;
+}
+
+int64_t storedFileBytes(const string& hash) {
+	int64_t bytes = 0;
+	for(const string& path : {getFileStoragePath(hash), compressedStoragePath(hash)}) {
+		struct stat statBuf;
+		if(stat(path.c_str(), &statBuf) == 0) bytes += statBuf.st_size;
+	}
+	return bytes;
+}
+
+int64_t removeStoredFile(const string& hash) {
+	int64_t bytes = 0;
+	for(const string& path : {getFileStoragePath(hash), compressedStoragePath(hash)}) {
+		struct stat statBuf;
+		if(stat(path.c_str(), &statBuf) == -1) continue;
+		if(unlink(path.c_str()) == 0) bytes += statBuf.st_size;
+	}
+	return bytes;
+}
+
+int migrateFileStore() {
+	DIR* dir = opendir("files");
+	if(!dir) {
+		if(errno == ENOENT) return 0;
+		throw Error("migrateFileStore: Could not open file store.");
+	}
+	vector<string> hashes;
+	while(struct dirent* entry = readdir(dir)) {
+		string name = entry->d_name;
+		if(isValidFileHash(name)) hashes.push_back(name);
+	}
+	closedir(dir);
+	
+	for(const string& hash : hashes) {
+		moveToStore("files/" + hash, hash, getFileStoragePath(hash));
+	}
+	
+	// Temporary files of the old layout are never completed.
+	dir = opendir("files");
+	if(!dir) throw Error("migrateFileStore: Could not open file store.");
+	vector<string> leftovers;
+	while(struct dirent* entry = readdir(dir)) {
+		string name = entry->d_name;
+		if(name.compare(0, 4, "tmp_") == 0 || name.compare(0, 8, "partial_") == 0) {
+			leftovers.push_back("files/" + name);
+		}
+	}
+	closedir(dir);
+	for(const string& path : leftovers) {
+		unlink(path.c_str());
+	}
+	return hashes.size();
 }
 
 }
@@ -2,6 +2,7 @@
 #include "common.hpp"
 #include <fstream>
 #include <cstdlib>
+#include <ctime>
 #include <openssl/sha.h>
 
 namespace cses {
@@ -9,7 +10,9 @@ namespace cses {
 // Process for saving a file.
 class FileSave {
 public:
-	FileSave();
+	// If compressedInput is set, the written data is a zstd frame of the file
+	// contents, which is stored as is.
+	FileSave(bool compressedInput = false);
 	~FileSave();
 	
 	void write(const char* data, size_t length);
@@ -21,14 +24,21 @@ public:
 	string save();
 	
 private:
-	void reset();
+	struct Impl;
 	
 	bool saveCalled;
+	bool compressedInput;
 	SHA_CTX shaCtx;
-	std::string tmpfilename;
-	std::ofstream tmpfile;
+	// Size of the uncompressed contents written so far.
+	int64_t size;
+	unique_ptr<Impl> impl;
 };
 
+// Compress files saved with FileSave from now on. Files that don't shrink are
+// still stored uncompressed. Hashes are always computed over the uncompressed
+// contents, and all read functions decompress transparently.
+void setFileCompression(bool enabled);
+
 string saveStringToFile(const string& data);
 
 string saveStreamToFile(std::istream& in);
@@ -36,12 +46,18 @@ string saveStreamToFile(std::istream& in);
 // Open file previously stored using FileSave by its hash. The stream is
 // returned as a pointer because of GCC bug, but it is never nullptr.
 // Parameter is not checked for sanity.
-unique_ptr<std::ifstream> openFileByHash(const string& hash);
+unique_ptr<std::istream> openFileByHash(const string& hash);
 
-// Get path where file is stored by its hash.
+// Get path where file is stored uncompressed by its hash. Files are stored as
+// files/ab/cd/abcd..., sharded by the first bytes of the hash. The file may
+// only be stored compressed, use materializeFile when the path must exist.
 // Parameter is not checked for sanity or existence.
 string getFileStoragePath(const string& hash);
 
+// Make sure the file is stored uncompressed, for example to hardlink it, and
+// return its path. Parameter is not checked for sanity.
+string materializeFile(const string& hash);
+
 // Check if file of given hash can be opened with openFileByHash.
 // Parameter is not checked for sanity.
 bool fileHashExists(const string& hash);
@@ -49,9 +65,136 @@ bool fileHashExists(const string& hash);
 // Check whether string is a valid file hash.
 bool isValidFileHash(const string& str);
 
+// Compute the hash that the data would have as a file, without saving it.
+string hashString(const string& data);
+
+// Read-only view of a stored file mapped into memory. Copies of the view share
+// the mapping, which is unmapped when the last copy is destroyed. A default
+// constructed view is empty.
+class FileView {
+public:
+	FileView();
+	
+	const char* data() const;
+	size_t size() const;
+	const char* begin() const { return data(); }
+	const char* end() const { return data() + size(); }
+	
+	// Copy of at most length bytes starting from offset. Returns empty string
+	// if offset is at or past the end.
+	string substr(size_t offset, size_t length) const;
+	string str() const;
+	
+private:
+	struct Mapping;
+	FileView(shared_ptr<const Mapping> mapping);
+	friend FileView mapFileByHash(const string& hash);
+	
+	shared_ptr<const Mapping> mapping;
+};
+
+// Map file previously stored using FileSave by its hash. Throws Error if the
+// file cannot be mapped. Parameter is not checked for sanity.
+FileView mapFileByHash(const string& hash);
+
+// Reads stored file in blocks, so that a compressed file is not decompressed
+// to memory all at once. Files stored uncompressed are mapped and read as a
+// single block. Parameter is not checked for sanity.
+class FileBlockReader {
+public:
+	FileBlockReader(const string& hash);
+	~FileBlockReader();
+	
+	// Get the next nonempty block, which stays valid until the next call.
+	// Returns false at the end of the file.
+	bool next(const char*& data, size_t& size);
+	
+private:
+	struct Impl;
+	
+	FileView view;
+	bool viewRead;
+	unique_ptr<Impl> impl;
+};
+
 string readFile(std::istream& in);
 
 //string readFileByName(const string& name);
 
 string readFileByHash(const string& hash);
+
+// Get size of stored file in bytes. Parameter is not checked for sanity.
+int64_t fileSizeByHash(const string& hash);
+
+// Read at most length bytes of stored file starting from offset. Returns
+// empty string if offset is at or past the end of file.
+string readFileChunkByHash(const string& hash, int64_t offset, size_t length);
+
+// Parse the integer at the beginning of stored file, such as an exit status
+// or a verdict written by an evaluator. Only the beginning of the file is
+// read. Returns nothing if the file doesn't start with an integer.
+optional<int> readIntegerFileByHash(const string& hash);
+
+// File in the store, with sizes of all its representations summed.
+struct StoredFileEntry {
+	string hash;
+	int64_t bytes = 0;
+	time_t modified = 0;
+};
+
+// List all files in the store, used for garbage collection.
+vector<StoredFileEntry> listStoredFiles();
+
+// Total size of the stored representations of the file, 0 if it is not stored.
+int64_t storedFileBytes(const string& hash);
+
+// Remove all representations of the file from the store. Returns the number
+// of bytes freed. Readers that already opened the file are not affected.
+int64_t removeStoredFile(const string& hash);
+
+// Move files stored in the old flat files/<hash> layout to their sharded
+// directories and remove leftover temporary files. Returns the number of files
+// moved.
+int migrateFileStore();
+
+// Representation of a stored file, used to transfer files without
+// decompressing them.
+struct StoredFileInfo {
+	int64_t size;
+	bool compressed;
+};
+
+// Get the stored representation of a file, preferring the compressed one.
+StoredFileInfo storedFileInfo(const string& hash);
+
+// Read at most length bytes of the stored representation of a file starting
+// from offset.
+string readStoredFileChunk(const string& hash, bool compressed, int64_t offset, size_t length);
+
+// Resumable saving of a file whose hash is known beforehand, used for chunked
+// transfers. The received data is kept in a partial file until commit, so
+// that after an interrupted transfer the data can be continued from
+// receivedBytes() instead of from the beginning.
+// Parameter is not checked for sanity.
+class PartialFile {
+public:
+	PartialFile(const string& hash);
+	
+	int64_t receivedBytes();
+	
+	// Append data to the end of the partial file. Throws Error if offset is
+	// not the current size of the partial file.
+	void append(int64_t offset, const char* data, size_t length);
+	
+	// Check that the received data matches the hash and move it to the file
+	// store. If compressed is set, the data is the compressed representation
+	// of the file. If it doesn't match, the partial data is discarded and
+	// false is returned.
+	bool commit(bool compressed = false);
+	
+private:
+	string hash;
+	string filename;
+};
+
 }
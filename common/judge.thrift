@@ -24,6 +24,66 @@ struct RunResult {
 	4:i64 memoryInBytes,
 }
 
+// Stored representation of a file, which may be compressed with zstd.
+struct StoredFileInfo {
+	1:i64 size,
+	2:bool compressed,
+}
+
+// Counters of the staging area that keeps run inputs in memory.
+struct CacheStats {
+	1:i64 hits,
+	2:i64 misses,
+	3:i64 bytes,
+	4:i64 byteBudget,
+}
+
+// Capacity and load of a judge host.
+struct JudgeStatus {
+	1:i32 cpuCount,
+	2:i32 slotCount,
+	3:i32 freeSlots,
+	// One minute load average.
+	4:double loadAverage,
+	5:i64 freeDiskBytes,
+	// Total size of the file store.
+	6:i64 cachedBytes,
+	// Sandbox types the host can run, "docker" and "ptrace".
+	7:list<string> sandboxTypes,
+	// Set when the host is being taken down for maintenance and should get
+	// no new work.
+	8:bool draining,
+	// Counters of the staging area, as returned by getCacheStats.
+	9:CacheStats stagingCache,
+}
+
+struct BatchTest {
+	1:string inputHash,
+	2:string correctHash,
+}
+
+struct BatchResult {
+	1:RunResult run,
+	// Missing if the run failed so that output was not evaluated.
+	2:optional RunResult evaluation,
+}
+
+// How program output is compared to the correct output. CUSTOM uses the
+// evaluator program, others are built into the judge.
+enum CheckerType {
+	CUSTOM,
+	EXACT,
+	IGNORE_WHITESPACE,
+	FLOAT,
+}
+
+struct Checker {
+	1:CheckerType type,
+	// Used by FLOAT, tokens are equal if either epsilon is satisfied.
+	2:double absoluteEpsilon,
+	3:double relativeEpsilon,
+}
+
 struct DockerImage {
 	1:string repository,
 	2:string id,
@@ -58,6 +118,15 @@ exception DockerError {
 }
 
 service Judge {
+	// Number of runs the judge can execute concurrently.
+	i32 getSlotCount(1:string token)
+		throws (1:InternalError a, 2:InvalidDataError b, 3:AuthError c, 4:DockerError d),
+	JudgeStatus status(1:string token)
+		throws (1:InternalError a, 2:InvalidDataError b, 3:AuthError c, 4:DockerError d),
+	// Hit ratio of staged run inputs.
+	CacheStats getCacheStats(1:string token)
+		throws (1:InternalError a, 2:InvalidDataError b, 3:AuthError c, 4:DockerError d),
+	
 	bool hasFile(1:string token, 2:string hash)
 		throws (1:InternalError a, 2:InvalidDataError b, 3:AuthError c, 4:DockerError d),
 	void sendFile(1:string token, 2:string data)
@@ -65,6 +134,48 @@ service Judge {
 	string getFile(1:string token, 2:string hash)
 		throws (1:InternalError a, 2:InvalidDataError b, 3:AuthError c, 4:DockerError d),
 	
+	// Chunked upload of a file with known hash. beginUpload returns the number
+	// of bytes of the file the judge already has, and the upload continues by
+	// appendUpload calls from that offset. commitUpload checks the hash and
+	// stores the file. If compressed is set, the uploaded data is the zstd
+	// compressed representation of the file.
+	i64 beginUpload(1:string token, 2:string hash)
+		throws (1:InternalError a, 2:InvalidDataError b, 3:AuthError c, 4:DockerError d),
+	void appendUpload(1:string token, 2:string hash, 3:i64 offset, 4:binary data)
+		throws (1:InternalError a, 2:InvalidDataError b, 3:AuthError c, 4:DockerError d),
+	void commitUpload(1:string token, 2:string hash, 3:bool compressed)
+		throws (1:InternalError a, 2:InvalidDataError b, 3:AuthError c, 4:DockerError d),
+	
+	// Chunked download of a stored file.
+	i64 getFileSize(1:string token, 2:string hash)
+		throws (1:InternalError a, 2:InvalidDataError b, 3:AuthError c, 4:DockerError d),
+	binary getFileChunk(1:string token, 2:string hash, 3:i64 offset, 4:i32 length)
+		throws (1:InternalError a, 2:InvalidDataError b, 3:AuthError c, 4:DockerError d),
+	// Chunked download of the stored representation of a file, which saves
+	// transfer when the file is stored compressed.
+	StoredFileInfo getStoredFileInfo(1:string token, 2:string hash)
+		throws (1:InternalError a, 2:InvalidDataError b, 3:AuthError c, 4:DockerError d),
+	binary getStoredFileChunk(1:string token, 2:string hash, 3:bool compressed, 4:i64 offset, 5:i32 length)
+		throws (1:InternalError a, 2:InvalidDataError b, 3:AuthError c, 4:DockerError d),
+	
+	// Returns those of the given hashes that the judge doesn't have.
+	list<string> missingFiles(1:string token, 2:list<string> hashes)
+		throws (1:InternalError a, 2:InvalidDataError b, 3:AuthError c, 4:DockerError d),
+	
 	RunResult run(1:string token, 2:Sandbox sandbox, 4:list<FileRef> inputs, 5:RunOptions options)
 		throws (1:InternalError a, 2:InvalidDataError b, 3:AuthError c, 4:DockerError d),
+	// Same as run, but first stores the given file contents, so that small
+	// missing inputs can be sent in the same call.
+	RunResult runWithFiles(1:string token, 2:Sandbox sandbox, 4:list<FileRef> inputs, 5:RunOptions options, 6:list<binary> files)
+		throws (1:InternalError a, 2:InvalidDataError b, 3:AuthError c, 4:DockerError d),
+	
+	// Run binary on each test input, evaluating the output against the correct
+	// output with the checker. Returns one result per test in order.
+	// Evaluator parameters are only used by the CUSTOM checker, built-in
+	// checkers report their verdict as stdout of the evaluation like the
+	// evaluator program does.
+	// If stopOnFailure is set, stops after the first test that fails.
+	// The given file contents are stored first as in runWithFiles.
+	list<BatchResult> runBatch(1:string token, 2:Sandbox runner, 3:string binaryHash, 4:list<BatchTest> tests, 5:RunOptions options, 6:Sandbox evaluator, 7:string evaluatorHash, 8:RunOptions evaluatorOptions, 9:bool stopOnFailure, 10:list<binary> files, 11:Checker checker)
+		throws (1:InternalError a, 2:InvalidDataError b, 3:AuthError c, 4:DockerError d),
 }
@@ -13,5 +13,16 @@ bool isSafeIdentifier(const string& str);
 // consist of 64 numbers and lowercase letters a-f.
 bool isValidImageID(const string& str);
 
+// Maximum length of a chunk in chunked file transfers.
+const size_t MAX_FILE_CHUNK_SIZE = 16 << 20;
+
+// Maximum total size of file contents sent inline with a run.
+const size_t MAX_INLINE_FILES_SIZE = 16 << 20;
+
+// Message of InvalidDataError thrown when a run needs files the judge doesn't
+// have, for example because they were removed to free space. The files
+// should be sent again.
+const char* const MISSING_FILES_MESSAGE = "Missing files.";
+
 }
 };
\ No newline at end of file
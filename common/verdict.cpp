@@ -0,0 +1,37 @@
+#include "verdict.hpp"
+#include "file.hpp"
+
+namespace cses {
+
+namespace {
+	optional<int> readIntegerOutput(const protocol::RunResult& result, const string& name) {
+		const protocol::FileRef* ref = findOutput(result, name);
+		if(!ref) return optional<int>();
+		return readIntegerFileByHash(ref->hash);
+	}
+}
+
+TestVerdict runVerdict(const protocol::RunResult& run, double timeLimit) {
+	if(run.timeInSeconds > timeLimit) return TestVerdict::TIME_LIMIT;
+	if(findOutput(run, "status")) {
+		optional<int> status = readIntegerOutput(run, "status");
+		if(!status || *status != 1) return TestVerdict::RUNTIME_ERROR;
+	}
+	if(!findOutput(run, "stdout")) return TestVerdict::INTERNAL_ERROR;
+	return TestVerdict::ACCEPTED;
+}
+
+TestVerdict evaluationVerdict(const protocol::RunResult& evaluation) {
+	optional<int> verdict = readIntegerOutput(evaluation, "stdout");
+	if(!verdict) return TestVerdict::INTERNAL_ERROR;
+	return *verdict ? TestVerdict::ACCEPTED : TestVerdict::WRONG_ANSWER;
+}
+
+const protocol::FileRef* findOutput(const protocol::RunResult& result, const string& name) {
+	for(const protocol::FileRef& ref : result.outputs) {
+		if(ref.name == name) return &ref;
+	}
+	return nullptr;
+}
+
+}
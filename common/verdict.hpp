@@ -0,0 +1,28 @@
+#pragma once
+#include "common.hpp"
+#include "gen-cpp/Judge.h"
+
+namespace cses {
+
+// Verdict of a test. The judge stops batches at the first test that is not
+// accepted, and the web server stores the same verdict as the result, so both
+// decide it here.
+enum class TestVerdict {
+	ACCEPTED,
+	WRONG_ANSWER,
+	TIME_LIMIT,
+	RUNTIME_ERROR,
+	INTERNAL_ERROR
+};
+
+// Verdict of running the program on a test. The output of an accepted run is
+// then evaluated.
+TestVerdict runVerdict(const protocol::RunResult& run, double timeLimit);
+
+// Verdict of the test given by the evaluation of the output.
+TestVerdict evaluationVerdict(const protocol::RunResult& evaluation);
+
+// Find output file of given name, or nullptr if there is none.
+const protocol::FileRef* findOutput(const protocol::RunResult& result, const string& name);
+
+}
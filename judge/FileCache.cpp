@@ -0,0 +1,99 @@
+#include "FileCache.hpp"
+#include "file.hpp"
+
+namespace cses {
+
+FileCache::FileCache(int64_t byteBudget) : byteBudget(byteBudget), totalBytes(0) {
+	vector<StoredFileEntry> stored = listStoredFiles();
+	sort(stored.begin(), stored.end(), [](const StoredFileEntry& a, const StoredFileEntry& b) {
+		return a.modified < b.modified;
+	});
+	std::lock_guard<std::mutex> lock(mutex);
+	for(const StoredFileEntry& file : stored) {
+		order.push_front(file.hash);
+		Entry& entry = entries[file.hash];
+		entry.bytes = file.bytes;
+		entry.pins = 0;
+		entry.position = order.begin();
+		totalBytes += file.bytes;
+	}
+	cerr << "File cache holds " << entries.size() << " files, " << totalBytes << " bytes\n";
+	evict();
+}
+
+void FileCache::touch(const string& hash) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = entries.find(hash);
+	if(it == entries.end()) return;
+	order.splice(order.begin(), order, it->second.position);
+}
+
+void FileCache::add(const string& hash) {
+	std::lock_guard<std::mutex> lock(mutex);
+	refresh(hash).keepUntil = Clock::now() + std::chrono::seconds(GRACE_PERIOD_SECONDS);
+	evict();
+}
+
+int64_t FileCache::size() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return totalBytes;
+}
+
+FileCache::Entry& FileCache::refresh(const string& hash) {
+	auto it = entries.find(hash);
+	if(it == entries.end()) {
+		order.push_front(hash);
+		Entry& entry = entries[hash];
+		entry.bytes = 0;
+		entry.pins = 0;
+		entry.position = order.begin();
+		it = entries.find(hash);
+	} else {
+		order.splice(order.begin(), order, it->second.position);
+	}
+	Entry& entry = it->second;
+	int64_t bytes = storedFileBytes(hash);
+	totalBytes += bytes - entry.bytes;
+	entry.bytes = bytes;
+	return entry;
+}
+
+void FileCache::evict() {
+	if(byteBudget == 0) return;
+	Clock::time_point now = Clock::now();
+	auto it = order.end();
+	while(totalBytes > byteBudget && it != order.begin()) {
+		--it;
+		Entry& entry = entries[*it];
+		if(entry.pins != 0 || entry.keepUntil > now) continue;
+		removeStoredFile(*it);
+		totalBytes -= entry.bytes;
+		entries.erase(*it);
+		it = order.erase(it);
+	}
+}
+
+FileCache::Pin::Pin(FileCache& cache, vector<string> hashes)
+	: cache(cache), hashes(move(hashes))
+{
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	for(const string& hash : this->hashes) {
+		++cache.refresh(hash).pins;
+	}
+}
+
+FileCache::Pin::~Pin() {
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	for(const string& hash : hashes) {
+		Entry& entry = cache.refresh(hash);
+		--entry.pins;
+		if(entry.pins == 0 && entry.bytes == 0) {
+			// The file was never stored.
+			cache.order.erase(entry.position);
+			cache.entries.erase(hash);
+		}
+	}
+	cache.evict();
+}
+
+}
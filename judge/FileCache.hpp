@@ -0,0 +1,70 @@
+#pragma once
+#include "common.hpp"
+#include <list>
+#include <mutex>
+#include <chrono>
+
+namespace cses {
+
+// Keeps the judge's file store within a byte budget by removing the least
+// recently used files. Files used by ongoing runs are pinned and never
+// removed, and added files are kept for a grace period so that the web server
+// can fetch outputs of runs. The web server sends removed files again when
+// they are needed.
+class FileCache {
+public:
+	// Budget 0 means unlimited. Existing files are ordered by modification
+	// time.
+	FileCache(int64_t byteBudget);
+	
+	// Mark the file as used now, if it is stored.
+	void touch(const string& hash);
+	
+	// Record a file that was stored and remove old files if over budget. The
+	// file itself is not removed within the grace period.
+	void add(const string& hash);
+	
+	// Total size of the stored files.
+	int64_t size();
+	
+	// Pins the files for its lifetime. Sizes are updated on destruction, as
+	// pinned files may be stored during the run.
+	class Pin {
+	public:
+		Pin(FileCache& cache, vector<string> hashes);
+		~Pin();
+		Pin(const Pin&) = delete;
+		Pin& operator=(const Pin&) = delete;
+	private:
+		FileCache& cache;
+		vector<string> hashes;
+	};
+
+private:
+	typedef std::chrono::steady_clock Clock;
+	
+	static const int GRACE_PERIOD_SECONDS = 300;
+	
+	struct Entry {
+		int64_t bytes;
+		int pins;
+		// Time until which the file is not removed.
+		Clock::time_point keepUntil;
+		// Position in order.
+		std::list<string>::iterator position;
+	};
+	
+	// Add or update entry and move it to the front. Must be called with the
+	// mutex held.
+	Entry& refresh(const string& hash);
+	void evict();
+	
+	std::mutex mutex;
+	int64_t byteBudget;
+	int64_t totalBytes;
+	// Most recently used first.
+	std::list<string> order;
+	unordered_map<string, Entry> entries;
+};
+
+}
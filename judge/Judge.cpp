@@ -2,6 +2,13 @@
 #include "run_docker.hpp"
 #include "Judge.hpp"
 #include "file.hpp"
+#include "judge_interface.hpp"
+#include "io_util.hpp"
+#include "compare.hpp"
+#include "verdict.hpp"
+#include <cstdlib>
+#include <sys/statvfs.h>
+#include <unistd.h>
 
 namespace cses {
 
@@ -12,6 +19,83 @@ namespace {
 		ret.msg = msg;
 		return ret;
 	}
+	
+	// The host reports that it is draining while this file exists in the
+	// working directory, so that it gets no new work.
+	const char* const DRAIN_FILE = "DRAIN";
+	
+	vector<string> supportedSandboxTypes() {
+		static const vector<string> types = []() {
+			vector<string> ret;
+			if(system("which docker.io > /dev/null 2>&1") == 0) ret.push_back("docker");
+			if(access("syscalls/restrict_syscalls", X_OK) == 0) ret.push_back("ptrace");
+			return ret;
+		}();
+		return types;
+	}
+	
+	// Files needed to run in the sandbox in addition to the inputs.
+	void addSandboxFiles(vector<string>& hashes, const protocol::Sandbox& sandbox) {
+		if(sandbox.__isset.ptrace) hashes.push_back(sandbox.ptrace.runnerHash);
+	}
+	
+	protocol::FileRef makeFileRef(const string& name, const string& hash) {
+		protocol::FileRef ref;
+		ref.name = name;
+		ref.hash = hash;
+		return ref;
+	}
+}
+
+int32_t Judge::getSlotCount(const string& token) {
+	if(token != correctToken) {
+		throw withMsg<protocol::AuthError>("Invalid token.");
+	}
+	return slotCount;
+}
+
+void Judge::status(protocol::JudgeStatus& _return, const string& token) {
+	try {
+		if(token != correctToken) {
+			throw withMsg<protocol::AuthError>("Invalid token.");
+		}
+		_return.cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+		_return.slotCount = slotCount;
+		{
+			std::unique_lock<std::mutex> lock(slotMutex);
+			_return.freeSlots = freeSlots;
+		}
+		double load;
+		_return.loadAverage = getloadavg(&load, 1) == 1 ? load : 0;
+		struct statvfs fs;
+		_return.freeDiskBytes = statvfs(".", &fs) == 0 ? (int64_t)fs.f_bavail * fs.f_frsize : 0;
+		_return.cachedBytes = fileCache.size();
+		_return.sandboxTypes = supportedSandboxTypes();
+		_return.draining = access(DRAIN_FILE, F_OK) == 0;
+		_return.stagingCache = cacheStats();
+	} catch(::apache::thrift::TException& e) {
+		throw;
+	} catch(std::exception& e) {
+		cerr << "Judge::status exception: " << e.what() << "\n";
+		throw protocol::InternalError();
+	}
+}
+
+void Judge::getCacheStats(protocol::CacheStats& _return, const string& token) {
+	if(token != correctToken) {
+		throw withMsg<protocol::AuthError>("Invalid token.");
+	}
+	_return = cacheStats();
+}
+
+protocol::CacheStats Judge::cacheStats() {
+	StagingArea::Stats stats = staging.stats();
+	protocol::CacheStats ret;
+	ret.hits = stats.hits;
+	ret.misses = stats.misses;
+	ret.bytes = stats.bytes;
+	ret.byteBudget = stats.byteBudget;
+	return ret;
 }
 
 bool Judge::hasFile(const string& token, const string& hash) {
@@ -39,7 +123,7 @@ void Judge::sendFile(const string& token, const string& data) {
 		
 		FileSave save;
 		save.write(data.data(), data.size());
-		save.save();
+		fileCache.add(save.save());
 	} catch(::apache::thrift::TException& e) {
 		throw;
 	} catch(std::exception& e) {
@@ -71,6 +155,212 @@ void Judge::getFile(
 	}
 }
 
+int64_t Judge::beginUpload(const string& token, const string& hash) {
+	try {
+		if(token != correctToken) {
+			throw withMsg<protocol::AuthError>("Invalid token.");
+		}
+		if(!isValidFileHash(hash)) {
+			throw withMsg<protocol::InvalidDataError>("Malformed hash " + hash);
+		}
+		
+		std::lock_guard<std::mutex> lock(uploadMutex);
+		if(fileHashExists(hash)) {
+			return fileSizeByHash(hash);
+		}
+		return PartialFile(hash).receivedBytes();
+	} catch(::apache::thrift::TException& e) {
+		throw;
+	} catch(std::exception& e) {
+		cerr << "Judge::beginUpload exception: " << e.what() << "\n";
+		throw protocol::InternalError();
+	}
+}
+void Judge::appendUpload(
+	const string& token,
+	const string& hash,
+	int64_t offset,
+	const string& data
+) {
+	try {
+		if(token != correctToken) {
+			throw withMsg<protocol::AuthError>("Invalid token.");
+		}
+		if(!isValidFileHash(hash)) {
+			throw withMsg<protocol::InvalidDataError>("Malformed hash " + hash);
+		}
+		if(data.size() > judge_interface::MAX_FILE_CHUNK_SIZE) {
+			throw withMsg<protocol::InvalidDataError>("Chunk too large.");
+		}
+		
+		std::lock_guard<std::mutex> lock(uploadMutex);
+		if(fileHashExists(hash)) return;
+		PartialFile partial(hash);
+		if(offset != partial.receivedBytes()) {
+			throw withMsg<protocol::InvalidDataError>("Upload offset does not match received data.");
+		}
+		partial.append(offset, data.data(), data.size());
+	} catch(::apache::thrift::TException& e) {
+		throw;
+	} catch(std::exception& e) {
+		cerr << "Judge::appendUpload exception: " << e.what() << "\n";
+		throw protocol::InternalError();
+	}
+}
+void Judge::commitUpload(const string& token, const string& hash, bool compressed) {
+	try {
+		if(token != correctToken) {
+			throw withMsg<protocol::AuthError>("Invalid token.");
+		}
+		if(!isValidFileHash(hash)) {
+			throw withMsg<protocol::InvalidDataError>("Malformed hash " + hash);
+		}
+		
+		std::lock_guard<std::mutex> lock(uploadMutex);
+		if(fileHashExists(hash)) return;
+		if(!PartialFile(hash).commit(compressed)) {
+			throw withMsg<protocol::InvalidDataError>("Uploaded data does not match hash.");
+		}
+		fileCache.add(hash);
+	} catch(::apache::thrift::TException& e) {
+		throw;
+	} catch(std::exception& e) {
+		cerr << "Judge::commitUpload exception: " << e.what() << "\n";
+		throw protocol::InternalError();
+	}
+}
+
+int64_t Judge::getFileSize(const string& token, const string& hash) {
+	try {
+		if(token != correctToken) {
+			throw withMsg<protocol::AuthError>("Invalid token.");
+		}
+		if(!isValidFileHash(hash)) {
+			throw withMsg<protocol::InvalidDataError>("Malformed hash.");
+		}
+		if(!fileHashExists(hash)) {
+			throw withMsg<protocol::InvalidDataError>("File does not exist.");
+		}
+		return fileSizeByHash(hash);
+	} catch(::apache::thrift::TException& e) {
+		throw;
+	} catch(std::exception& e) {
+		cerr << "Judge::getFileSize exception: " << e.what() << "\n";
+		throw protocol::InternalError();
+	}
+}
+void Judge::getFileChunk(
+	string& _return,
+	const string& token,
+	const string& hash,
+	int64_t offset,
+	int32_t length
+) {
+	try {
+		if(token != correctToken) {
+			throw withMsg<protocol::AuthError>("Invalid token.");
+		}
+		if(!isValidFileHash(hash)) {
+			throw withMsg<protocol::InvalidDataError>("Malformed hash.");
+		}
+		if(offset < 0 || length < 0 || (size_t)length > judge_interface::MAX_FILE_CHUNK_SIZE) {
+			throw withMsg<protocol::InvalidDataError>("Invalid chunk range.");
+		}
+		if(!fileHashExists(hash)) {
+			throw withMsg<protocol::InvalidDataError>("File does not exist.");
+		}
+		_return = readFileChunkByHash(hash, offset, length);
+	} catch(::apache::thrift::TException& e) {
+		throw;
+	} catch(std::exception& e) {
+		cerr << "Judge::getFileChunk exception: " << e.what() << "\n";
+		throw protocol::InternalError();
+	}
+}
+
+void Judge::getStoredFileInfo(
+	protocol::StoredFileInfo& _return,
+	const string& token,
+	const string& hash
+) {
+	try {
+		if(token != correctToken) {
+			throw withMsg<protocol::AuthError>("Invalid token.");
+		}
+		if(!isValidFileHash(hash)) {
+			throw withMsg<protocol::InvalidDataError>("Malformed hash.");
+		}
+		if(!fileHashExists(hash)) {
+			throw withMsg<protocol::InvalidDataError>("File does not exist.");
+		}
+		StoredFileInfo info = storedFileInfo(hash);
+		_return.size = info.size;
+		_return.compressed = info.compressed;
+	} catch(::apache::thrift::TException& e) {
+		throw;
+	} catch(std::exception& e) {
+		cerr << "Judge::getStoredFileInfo exception: " << e.what() << "\n";
+		throw protocol::InternalError();
+	}
+}
+void Judge::getStoredFileChunk(
+	string& _return,
+	const string& token,
+	const string& hash,
+	bool compressed,
+	int64_t offset,
+	int32_t length
+) {
+	try {
+		if(token != correctToken) {
+			throw withMsg<protocol::AuthError>("Invalid token.");
+		}
+		if(!isValidFileHash(hash)) {
+			throw withMsg<protocol::InvalidDataError>("Malformed hash.");
+		}
+		if(offset < 0 || length < 0 || (size_t)length > judge_interface::MAX_FILE_CHUNK_SIZE) {
+			throw withMsg<protocol::InvalidDataError>("Invalid chunk range.");
+		}
+		if(!fileHashExists(hash)) {
+			throw withMsg<protocol::InvalidDataError>("File does not exist.");
+		}
+		_return = readStoredFileChunk(hash, compressed, offset, length);
+	} catch(::apache::thrift::TException& e) {
+		throw;
+	} catch(std::exception& e) {
+		cerr << "Judge::getStoredFileChunk exception: " << e.what() << "\n";
+		throw protocol::InternalError();
+	}
+}
+
+void Judge::missingFiles(
+	vector<string>& _return,
+	const string& token,
+	const vector<string>& hashes
+) {
+	try {
+		if(token != correctToken) {
+			throw withMsg<protocol::AuthError>("Invalid token.");
+		}
+		for(const string& hash : hashes) {
+			if(!isValidFileHash(hash)) {
+				throw withMsg<protocol::InvalidDataError>("Malformed hash " + hash);
+			}
+			if(fileHashExists(hash)) {
+				// The files are about to be used.
+				fileCache.touch(hash);
+			} else {
+				_return.push_back(hash);
+			}
+		}
+	} catch(::apache::thrift::TException& e) {
+		throw;
+	} catch(std::exception& e) {
+		cerr << "Judge::missingFiles exception: " << e.what() << "\n";
+		throw protocol::InternalError();
+	}
+}
+
 void Judge::run(
 	protocol::RunResult& _return,
 	const string& token,
@@ -82,14 +372,19 @@ void Judge::run(
 		if(token != correctToken) {
 			throw withMsg<protocol::AuthError>("Invalid token.");
 		}
-		if (sandbox.__isset.docker) {
-			runDocker(_return, sandbox.docker.repository, sandbox.docker.id, inputs, options);
-		} else if (sandbox.__isset.ptrace) {
-			runPTrace(_return, sandbox.ptrace, inputs, options);
-		} else {
-			cerr << "Unknown sandbox type.\n";
-			throw protocol::InternalError();
+		vector<string> needed;
+		for(const protocol::FileRef& input : inputs) {
+			needed.push_back(input.hash);
 		}
+		addSandboxFiles(needed, sandbox);
+		FileCache::Pin pin(fileCache, needed);
+		requireFiles(needed);
+		
+		SlotGuard slot(*this);
+		runSandbox(_return, sandbox, inputs, options);
+		addOutputs(_return);
+	} catch(::apache::thrift::TException& e) {
+		throw;
 	} catch(std::exception& e) {
 		cerr << "Judge::run exception: " << e.what() << "\n";
 		protocol::InternalError err;
@@ -98,4 +393,191 @@ void Judge::run(
 	}
 }
 
+void Judge::runWithFiles(
+	protocol::RunResult& _return,
+	const string& token,
+	const protocol::Sandbox& sandbox,
+	const vector<protocol::FileRef>& inputs,
+	const protocol::RunOptions& options,
+	const vector<string>& files
+) {
+	try {
+		if(token != correctToken) {
+			throw withMsg<protocol::AuthError>("Invalid token.");
+		}
+		saveInlineFiles(files);
+	} catch(::apache::thrift::TException& e) {
+		throw;
+	} catch(std::exception& e) {
+		cerr << "Judge::runWithFiles exception: " << e.what() << "\n";
+		throw protocol::InternalError();
+	}
+	
+	run(_return, token, sandbox, inputs, options);
+}
+
+void Judge::runBatch(
+	vector<protocol::BatchResult>& _return,
+	const string& token,
+	const protocol::Sandbox& runner,
+	const string& binaryHash,
+	const vector<protocol::BatchTest>& tests,
+	const protocol::RunOptions& options,
+	const protocol::Sandbox& evaluator,
+	const string& evaluatorHash,
+	const protocol::RunOptions& evaluatorOptions,
+	bool stopOnFailure,
+	const vector<string>& files,
+	const protocol::Checker& checker
+) {
+	try {
+		if(token != correctToken) {
+			throw withMsg<protocol::AuthError>("Invalid token.");
+		}
+		saveInlineFiles(files);
+		
+		vector<string> needed{binaryHash};
+		addSandboxFiles(needed, runner);
+		for(const protocol::BatchTest& test : tests) {
+			needed.push_back(test.inputHash);
+			needed.push_back(test.correctHash);
+		}
+		if(checker.type == protocol::CheckerType::CUSTOM) {
+			needed.push_back(evaluatorHash);
+			addSandboxFiles(needed, evaluator);
+		}
+		FileCache::Pin pin(fileCache, needed);
+		requireFiles(needed);
+		
+		SlotGuard slot(*this);
+		for(const protocol::BatchTest& test : tests) {
+			protocol::BatchResult batchResult;
+			
+			vector<protocol::FileRef> runInputs;
+			runInputs.push_back(makeFileRef("binary", binaryHash));
+			runInputs.push_back(makeFileRef("input", test.inputHash));
+			runSandbox(batchResult.run, runner, runInputs, options);
+			addOutputs(batchResult.run);
+			
+			TestVerdict verdict = runVerdict(batchResult.run, options.timeLimit);
+			if(verdict == TestVerdict::ACCEPTED) {
+				protocol::RunResult evaluation;
+				evaluateOutput(evaluation, test, findOutput(batchResult.run, "stdout")->hash,
+					evaluator, evaluatorHash, evaluatorOptions, checker);
+				addOutputs(evaluation);
+				verdict = evaluationVerdict(evaluation);
+				batchResult.__set_evaluation(evaluation);
+			}
+			
+			_return.push_back(batchResult);
+			if(verdict != TestVerdict::ACCEPTED && stopOnFailure) break;
+		}
+	} catch(::apache::thrift::TException& e) {
+		throw;
+	} catch(std::exception& e) {
+		cerr << "Judge::runBatch exception: " << e.what() << "\n";
+		throw protocol::InternalError();
+	}
+}
+
+Judge::SlotGuard::SlotGuard(Judge& judge) : judge(judge) {
+	std::unique_lock<std::mutex> lock(judge.slotMutex);
+	judge.slotCondition.wait(lock, [&]() { return judge.freeSlots > 0; });
+	--judge.freeSlots;
+}
+Judge::SlotGuard::~SlotGuard() {
+	std::unique_lock<std::mutex> lock(judge.slotMutex);
+	++judge.freeSlots;
+	judge.slotCondition.notify_one();
+}
+
+void Judge::runSandbox(
+	protocol::RunResult& _return,
+	const protocol::Sandbox& sandbox,
+	const vector<protocol::FileRef>& inputs,
+	const protocol::RunOptions& options
+) {
+	if (sandbox.__isset.docker) {
+		runDocker(_return, sandbox.docker.repository, sandbox.docker.id, inputs, options, staging);
+	} else if (sandbox.__isset.ptrace) {
+		runPTrace(_return, sandbox.ptrace, inputs, options, staging, launcher, slotCount);
+	} else {
+		cerr << "Unknown sandbox type.\n";
+		throw protocol::InternalError();
+	}
+}
+
+void Judge::evaluateOutput(
+	protocol::RunResult& _return,
+	const protocol::BatchTest& test,
+	const string& outputHash,
+	const protocol::Sandbox& evaluator,
+	const string& evaluatorHash,
+	const protocol::RunOptions& evaluatorOptions,
+	const protocol::Checker& checker
+) {
+	bool accepted;
+	switch(checker.type) {
+	case protocol::CheckerType::CUSTOM: {
+		vector<protocol::FileRef> evalInputs;
+		evalInputs.push_back(makeFileRef("binary", evaluatorHash));
+		evalInputs.push_back(makeFileRef("output", outputHash));
+		evalInputs.push_back(makeFileRef("input", test.inputHash));
+		evalInputs.push_back(makeFileRef("correct", test.correctHash));
+		runSandbox(_return, evaluator, evalInputs, evaluatorOptions);
+		return;
+	}
+	case protocol::CheckerType::EXACT:
+		accepted = compareExact(outputHash, test.correctHash);
+		break;
+	case protocol::CheckerType::IGNORE_WHITESPACE:
+		accepted = compareIgnoreWhitespace(outputHash, test.correctHash);
+		break;
+	case protocol::CheckerType::FLOAT:
+		accepted = compareFloat(outputHash, test.correctHash,
+			checker.absoluteEpsilon, checker.relativeEpsilon);
+		break;
+	default:
+		throw withMsg<protocol::InvalidDataError>("Unknown checker type.");
+	}
+	// Report the verdict in the same form as evaluator programs.
+	_return.type = protocol::RunResultType::SUCCESS;
+	_return.timeInSeconds = 0;
+	_return.memoryInBytes = 0;
+	_return.outputs.push_back(makeFileRef("stdout", saveStringToFile(accepted ? "1\n" : "0\n")));
+}
+
+void Judge::saveInlineFiles(const vector<string>& files) {
+	size_t totalSize = 0;
+	for(const string& data : files) {
+		totalSize += data.size();
+	}
+	if(totalSize > judge_interface::MAX_INLINE_FILES_SIZE) {
+		throw withMsg<protocol::InvalidDataError>("Inline files too large.");
+	}
+	
+	for(const string& data : files) {
+		FileSave save;
+		save.write(data.data(), data.size());
+		fileCache.add(save.save());
+	}
+}
+
+void Judge::requireFiles(const vector<string>& hashes) {
+	for(const string& hash : hashes) {
+		if(!isValidFileHash(hash)) {
+			throw withMsg<protocol::InvalidDataError>("Malformed hash " + hash);
+		}
+		if(!fileHashExists(hash)) {
+			throw withMsg<protocol::InvalidDataError>(judge_interface::MISSING_FILES_MESSAGE);
+		}
+	}
+}
+
+void Judge::addOutputs(const protocol::RunResult& result) {
+	for(const protocol::FileRef& output : result.outputs) {
+		fileCache.add(output.hash);
+	}
+}
+
 }
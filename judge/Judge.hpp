@@ -1,11 +1,31 @@
 #include "common.hpp"
 #include "gen-cpp/Judge.h"
+#include "FileCache.hpp"
+#include "StagingArea.hpp"
+#include "Launcher.hpp"
+#include <mutex>
+#include <condition_variable>
 
 namespace cses {
 
 class Judge: public protocol::JudgeIf {
 public:
-	Judge(const string& authToken) : correctToken(authToken) { }
+	Judge(
+		const string& authToken,
+		int slotCount,
+		int64_t cacheBytes,
+		const string& stagingDirectory,
+		int64_t stagingBytes,
+		const string& launcherSocket
+	)
+		: correctToken(authToken), fileCache(cacheBytes),
+		  staging(stagingDirectory, stagingBytes),
+		  launcher(launcherSocket),
+		  slotCount(slotCount), freeSlots(slotCount) { }
+	
+	virtual int32_t getSlotCount(const string& token) override;
+	virtual void getCacheStats(protocol::CacheStats& _return, const string& token) override;
+	virtual void status(protocol::JudgeStatus& _return, const string& token) override;
 	
 	virtual bool hasFile(const string& token, const string& hash) override;
 	virtual void sendFile(const string& token, const string& data) override;
@@ -16,6 +36,44 @@ public:
 		const string& hash
 	) override;
 	
+	virtual int64_t beginUpload(const string& token, const string& hash) override;
+	virtual void appendUpload(
+		const string& token,
+		const string& hash,
+		int64_t offset,
+		const string& data
+	) override;
+	virtual void commitUpload(const string& token, const string& hash, bool compressed) override;
+	
+	virtual int64_t getFileSize(const string& token, const string& hash) override;
+	virtual void getFileChunk(
+		string& _return,
+		const string& token,
+		const string& hash,
+		int64_t offset,
+		int32_t length
+	) override;
+	
+	virtual void getStoredFileInfo(
+		protocol::StoredFileInfo& _return,
+		const string& token,
+		const string& hash
+	) override;
+	virtual void getStoredFileChunk(
+		string& _return,
+		const string& token,
+		const string& hash,
+		bool compressed,
+		int64_t offset,
+		int32_t length
+	) override;
+	
+	virtual void missingFiles(
+		vector<string>& _return,
+		const string& token,
+		const vector<string>& hashes
+	) override;
+	
 	virtual void run(
 		protocol::RunResult& _return,
 		const string& token,
@@ -24,8 +82,76 @@ public:
 		const protocol::RunOptions& options
 	) override;
 	
+	virtual void runWithFiles(
+		protocol::RunResult& _return,
+		const string& token,
+		const protocol::Sandbox& sandbox,
+		const vector<protocol::FileRef>& inputs,
+		const protocol::RunOptions& options,
+		const vector<string>& files
+	) override;
+	
+	virtual void runBatch(
+		vector<protocol::BatchResult>& _return,
+		const string& token,
+		const protocol::Sandbox& runner,
+		const string& binaryHash,
+		const vector<protocol::BatchTest>& tests,
+		const protocol::RunOptions& options,
+		const protocol::Sandbox& evaluator,
+		const string& evaluatorHash,
+		const protocol::RunOptions& evaluatorOptions,
+		bool stopOnFailure,
+		const vector<string>& files,
+		const protocol::Checker& checker
+	) override;
+	
 private:
+	// Holds one of the execution slots for its lifetime, waiting for a slot to
+	// become free if necessary.
+	class SlotGuard {
+	public:
+		SlotGuard(Judge& judge);
+		~SlotGuard();
+	private:
+		Judge& judge;
+	};
+	
+	void runSandbox(
+		protocol::RunResult& _return,
+		const protocol::Sandbox& sandbox,
+		const vector<protocol::FileRef>& inputs,
+		const protocol::RunOptions& options
+	);
+	void saveInlineFiles(const vector<string>& files);
+	protocol::CacheStats cacheStats();
+	// Throw InvalidDataError if some of the files are missing.
+	void requireFiles(const vector<string>& hashes);
+	// Record output files of the run in the file cache.
+	void addOutputs(const protocol::RunResult& result);
+	void evaluateOutput(
+		protocol::RunResult& _return,
+		const protocol::BatchTest& test,
+		const string& outputHash,
+		const protocol::Sandbox& evaluator,
+		const string& evaluatorHash,
+		const protocol::RunOptions& evaluatorOptions,
+		const protocol::Checker& checker
+	);
+	
 	string correctToken;
+	
+	FileCache fileCache;
+	StagingArea staging;
+	Launcher launcher;
+	
+	// Serializes operations on partial uploads.
+	std::mutex uploadMutex;
+	
+	int slotCount;
+	int freeSlots;
+	std::mutex slotMutex;
+	std::condition_variable slotCondition;
 };
 
 }
@@ -0,0 +1,41 @@
+#include "Launcher.hpp"
+#include <cstring>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace cses {
+
+launch::Result Launcher::run(const launch::Request& request) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if(socketPath.size() >= sizeof(address.sun_path)) {
+		throw Error("Launcher: Socket path too long.");
+	}
+	strcpy(address.sun_path, socketPath.c_str());
+	
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0) throw Error(string("Launcher: socket failed: ") + strerror(errno));
+	struct timeval timeout;
+	timeout.tv_sec = request.timeLimitSeconds + ANSWER_MARGIN_SECONDS;
+	timeout.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	
+	string answer;
+	bool ok = connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0 &&
+		launch::sendMessage(fd, launch::encode(request)) &&
+		launch::receiveMessage(fd, answer);
+	int error = errno;
+	close(fd);
+	if(!ok) throw Error("Launcher: Calling " + socketPath + " failed: " + strerror(error));
+	try {
+		return launch::decodeResult(answer);
+	} catch(const std::exception& e) {
+		throw Error(string("Launcher: ") + e.what());
+	}
+}
+
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "common.hpp"
+#include "launcher/launch_protocol.hpp"
+
+namespace cses {
+
+// Client of the sandbox launcher daemon in launcher/, which runs programs as
+// the sandbox user without spawning helper processes for each run.
+class Launcher {
+public:
+	// Empty socket path disables the launcher.
+	Launcher(const string& socketPath) : socketPath(socketPath) { }
+	
+	bool enabled() const { return !socketPath.empty(); }
+	
+	// Throws Error if the launcher can't be reached.
+	launch::Result run(const launch::Request& request);
+
+private:
+	// Time allowed for the launcher to answer in addition to the time limit.
+	static const int ANSWER_MARGIN_SECONDS = 30;
+	
+	string socketPath;
+};
+
+}
@@ -0,0 +1,169 @@
+#include "StagingArea.hpp"
+#include "file.hpp"
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cses {
+
+namespace {
+	void makeDirectory(const string& path) {
+		if(mkdir(path.c_str(), 0755) == -1 && errno != EEXIST) {
+			throw Error("StagingArea: Could not create directory " + path + ".");
+		}
+	}
+	
+	// Write the contents of the stored file to the descriptor. Returns the
+	// number of bytes written.
+	int64_t writeStoredFile(const string& hash, int fd) {
+		unique_ptr<std::istream> in = openFileByHash(hash);
+		int64_t bytes = 0;
+		char buf[1 << 16];
+		while(*in) {
+			in->read(buf, sizeof(buf));
+			const char* pos = buf;
+			std::streamsize left = in->gcount();
+			bytes += left;
+			while(left > 0) {
+				ssize_t written = write(fd, pos, left);
+				if(written == -1) {
+					if(errno == EINTR) continue;
+					throw Error("StagingArea: Could not write input file.");
+				}
+				pos += written;
+				left -= written;
+			}
+		}
+		if(in->bad()) throw Error("StagingArea: Could not read stored file " + hash + ".");
+		return bytes;
+	}
+	
+	// Remove regular files left in the directory by an earlier run.
+	void clearDirectory(const string& path) {
+		DIR* dir = opendir(path.c_str());
+		if(!dir) throw Error("StagingArea: Could not open directory " + path + ".");
+		while(struct dirent* entry = readdir(dir)) {
+			if(entry->d_type != DT_REG) continue;
+			unlink((path + "/" + entry->d_name).c_str());
+		}
+		closedir(dir);
+	}
+}
+
+StagingArea::StagingArea(const string& directory, int64_t byteBudget)
+	: directory(directory), byteBudget(byteBudget)
+{
+	if(directory.empty()) {
+		makeDirectory("tmp");
+		tempDirectory = "tmp";
+		return;
+	}
+	makeDirectory(directory);
+	makeDirectory(directory + "/files");
+	makeDirectory(directory + "/tmp");
+	clearDirectory(directory + "/files");
+	tempDirectory = directory + "/tmp";
+}
+
+void StagingArea::link(const string& hash, const string& to) {
+	if(directory.empty()) {
+		if(::link(getFileStoragePath(hash).c_str(), to.c_str()) == 0) return;
+		if(errno != ENOENT) throw Error("Could not hardlink input file.");
+		// Compressed files are decompressed to the run directory, which is
+		// removed with the run, instead of keeping a copy in the store.
+		int fd = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if(fd == -1) throw Error("Could not create input file.");
+		try {
+			writeStoredFile(hash, fd);
+		} catch(...) {
+			close(fd);
+			throw;
+		}
+		close(fd);
+		return;
+	}
+	bool counted = false;
+	while(true) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto it = entries.find(hash);
+			if(it != entries.end()) {
+				if(!counted) ++hits;
+				order.splice(order.begin(), order, it->second.position);
+				// Linking under the mutex so that the copy is not evicted
+				// in between.
+				if(::link(stagedPath(hash).c_str(), to.c_str()) == -1) {
+					throw Error("Could not hardlink staged input file.");
+				}
+				return;
+			}
+			if(!counted) ++misses;
+			counted = true;
+		}
+		// Staged copies of this file may have been evicted after staging,
+		// in which case it is staged again.
+		stage(hash);
+	}
+}
+
+StagingArea::Stats StagingArea::stats() {
+	std::lock_guard<std::mutex> lock(mutex);
+	Stats ret;
+	ret.hits = hits;
+	ret.misses = misses;
+	ret.bytes = totalBytes;
+	ret.byteBudget = byteBudget;
+	return ret;
+}
+
+string StagingArea::stagedPath(const string& hash) const {
+	return directory + "/files/" + hash;
+}
+
+void StagingArea::stage(const string& hash) {
+	// Copied without holding the mutex, so concurrent runs may stage the
+	// same file. The rename makes that harmless.
+	string tmpName = directory + "/files/.tmpXXXXXX";
+	int fd = mkstemp(&tmpName[0]);
+	if(fd == -1) throw Error("StagingArea: Could not create temporary file.");
+	int64_t bytes;
+	try {
+		bytes = writeStoredFile(hash, fd);
+		if(fchmod(fd, 0644) == -1) throw Error("StagingArea: Could not set permissions.");
+	} catch(...) {
+		close(fd);
+		unlink(tmpName.c_str());
+		throw;
+	}
+	close(fd);
+	
+	std::lock_guard<std::mutex> lock(mutex);
+	if(rename(tmpName.c_str(), stagedPath(hash).c_str()) == -1) {
+		unlink(tmpName.c_str());
+		throw Error("StagingArea: Could not move staged file.");
+	}
+	auto it = entries.find(hash);
+	if(it == entries.end()) {
+		order.push_front(hash);
+		Entry& entry = entries[hash];
+		entry.bytes = bytes;
+		entry.position = order.begin();
+		totalBytes += bytes;
+	} else {
+		order.splice(order.begin(), order, it->second.position);
+	}
+	evict();
+}
+
+void StagingArea::evict() {
+	while(totalBytes > byteBudget && order.size() > 1) {
+		const string& hash = order.back();
+		unlink(stagedPath(hash).c_str());
+		totalBytes -= entries[hash].bytes;
+		entries.erase(hash);
+		order.pop_back();
+	}
+}
+
+}
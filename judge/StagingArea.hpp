@@ -0,0 +1,60 @@
+#pragma once
+#include "common.hpp"
+#include <list>
+#include <mutex>
+
+namespace cses {
+
+// Keeps copies of recently used run inputs in a directory that is meant to
+// be on tmpfs, so that sandboxes read hot test data from memory. Temporary
+// run directories are created in the same directory, so that inputs can be
+// hardlinked to them. Least recently used copies are removed when the total
+// size exceeds the byte budget.
+class StagingArea {
+public:
+	// Empty directory disables staging, inputs are then linked from the file
+	// store, or decompressed if stored compressed, and temporary directories
+	// are created in tmp.
+	StagingArea(const string& directory, int64_t byteBudget);
+	
+	// Directory where temporary run directories should be created.
+	const string& tempRoot() const { return tempDirectory; }
+	
+	// Hardlink the stored file to the given path, staging it first if needed.
+	void link(const string& hash, const string& to);
+	
+	struct Stats {
+		int64_t hits;
+		int64_t misses;
+		int64_t bytes;
+		int64_t byteBudget;
+	};
+	Stats stats();
+
+private:
+	struct Entry {
+		int64_t bytes;
+		// Position in order.
+		std::list<string>::iterator position;
+	};
+	
+	string stagedPath(const string& hash) const;
+	// Copy the stored file to the staging directory.
+	void stage(const string& hash);
+	// Remove least recently used copies, except the most recent one. Must be
+	// called with the mutex held.
+	void evict();
+	
+	string directory;
+	string tempDirectory;
+	std::mutex mutex;
+	int64_t byteBudget;
+	int64_t totalBytes = 0;
+	int64_t hits = 0;
+	int64_t misses = 0;
+	// Most recently used first.
+	std::list<string> order;
+	unordered_map<string, Entry> entries;
+};
+
+}
@@ -4,19 +4,50 @@
 #include "common/judge_interface.hpp"
 #include <dirent.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 namespace cses {
 using namespace judge_interface;
 
-TempDir::TempDir() {
-	char tmpdirnameBuf[] = "tmp/XXXXXX";
-	if(mkdtemp(tmpdirnameBuf) == nullptr) throw Error("Creating temporary directory failed.");
-	char* cwd = getcwd(0,0);
-	name = string(cwd) + "/" + tmpdirnameBuf;
-	free(cwd);
+namespace {
+	// Remove the directory tree without spawning rm, as this is done twice
+	// for every run.
+	void removeTree(const string& path) {
+		struct stat st;
+		if(lstat(path.c_str(), &st) != 0) return;
+		if(S_ISDIR(st.st_mode)) {
+			DIR* dir = opendir(path.c_str());
+			if(dir != nullptr) {
+				vector<string> names;
+				while(struct dirent* ent = readdir(dir)) {
+					string name = ent->d_name;
+					if(name != "." && name != "..") names.push_back(name);
+				}
+				closedir(dir);
+				for(const string& name : names) {
+					removeTree(path + "/" + name);
+				}
+			}
+			if(rmdir(path.c_str()) != 0) cerr << "Removing " << path << " failed\n";
+		} else {
+			if(unlink(path.c_str()) != 0) cerr << "Removing " << path << " failed\n";
+		}
+	}
+}
+
+TempDir::TempDir(StagingArea& staging) : staging(staging) {
+	string tmpdirname = staging.tempRoot() + "/XXXXXX";
+	if(mkdtemp(&tmpdirname[0]) == nullptr) throw Error("Creating temporary directory failed.");
+	if(tmpdirname[0] == '/') {
+		name = tmpdirname;
+	} else {
+		char* cwd = getcwd(0,0);
+		name = string(cwd) + "/" + tmpdirname;
+		free(cwd);
+	}
 }
 TempDir::~TempDir() {
-	system(("rm -rf " + name).c_str());
+	removeTree(name);
 }
 void TempDir::saveContents(const std::string& subdir, protocol::RunResult& res) {
 	std::string outdirName = name + "/" + subdir;
@@ -32,10 +63,14 @@ void TempDir::saveContents(const std::string& subdir, protocol::RunResult& res)
 		
 		string fullName = outdirName + "/" + name;
 		
-		string cmd = "sudo chmod 666 " + fullName;
-		int err = system(cmd.c_str());
-		if(err==-1 || WEXITSTATUS(err) != 0) {
-			throw Error("Command failed: " + cmd);
+		// Files of the sandbox user are readable if the launcher has
+		// given them to the judge.
+		if(access(fullName.c_str(), R_OK) != 0) {
+			string cmd = "sudo chmod 666 " + fullName;
+			int err = system(cmd.c_str());
+			if(err==-1 || WEXITSTATUS(err) != 0) {
+				throw Error("Command failed: " + cmd);
+			}
 		}
 		
 		FileSave save;
@@ -54,12 +89,9 @@ void TempDir::saveContents(const std::string& subdir, protocol::RunResult& res)
 }
 void TempDir::hardlinkInputs(const vector<protocol::FileRef>& inputs) {
 	for(const protocol::FileRef& input : inputs) {
-		string from = getFileStoragePath(input.hash);
 		string to = name + "/" + input.name;
-		cerr<<"Linkin "<<from<<" to "<<to<<'\n';
-		if(link(from.c_str(), to.c_str()) == -1) {
-			throw Error("Could not hardlink input file.");
-		}
+		cerr<<"Linkin "<<input.hash<<" to "<<to<<'\n';
+		staging.link(input.hash, to);
 	}
 }
 
@@ -1,17 +1,20 @@
 #pragma once
 #include "gen-cpp/Judge.h"
+#include "StagingArea.hpp"
 #include <vector>
 
 namespace cses {
 
 struct TempDir {
-	TempDir();
+	// Created in the temporary directory of the staging area.
+	TempDir(StagingArea& staging);
 	~TempDir();
 	const std::string& getName() const { return name; }
 	void saveContents(const std::string& subdir, protocol::RunResult& res);
 	void hardlinkInputs(const std::vector<protocol::FileRef>& inputs);
 
 private:
+	StagingArea& staging;
 	std::string name;
 };
 
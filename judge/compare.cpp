@@ -0,0 +1,168 @@
+#include "compare.hpp"
+#include "file.hpp"
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace cses {
+
+namespace {
+	bool isWhitespace(char c) {
+		return c == ' ' || (c >= '\t' && c <= '\r');
+	}
+
+#ifdef __SSE2__
+	// Bit i is set if byte i of the block is whitespace.
+	unsigned whitespaceMask(const char* pos) {
+		__m128i block = _mm_loadu_si128((const __m128i*)pos);
+		__m128i ws = _mm_cmpeq_epi8(block, _mm_set1_epi8(' '));
+		for(char c : {'\t', '\n', '\v', '\f', '\r'}) {
+			ws = _mm_or_si128(ws, _mm_cmpeq_epi8(block, _mm_set1_epi8(c)));
+		}
+		return _mm_movemask_epi8(ws);
+	}
+#endif
+
+	// Find the first character in [pos, end) that is whitespace if
+	// whitespace is true, or non-whitespace otherwise.
+	const char* findClass(const char* pos, const char* end, bool whitespace) {
+#ifdef __SSE2__
+		while(end - pos >= 16) {
+			unsigned mask = whitespaceMask(pos);
+			if(!whitespace) mask = ~mask & 0xFFFF;
+			if(mask) return pos + __builtin_ctz(mask);
+			pos += 16;
+		}
+#endif
+		while(pos != end && isWhitespace(*pos) != whitespace) ++pos;
+		return pos;
+	}
+
+	// Splits stored file into whitespace separated tokens. Tokens are read
+	// from the blocks of the file in place, and copied only if they continue
+	// from one block to the next.
+	class TokenReader {
+	public:
+		TokenReader(const string& hash) : reader(hash) { }
+
+		// Move to next token, returning false if there is none.
+		bool next() {
+			while(true) {
+				pos = findClass(pos, end, false);
+				if(pos != end) break;
+				if(!nextBlock()) return false;
+			}
+			tokenBegin = pos;
+			pos = findClass(pos, end, true);
+			length = pos - tokenBegin;
+			if(pos != end) return true;
+			spanning.assign(tokenBegin, pos);
+			while(pos == end && nextBlock()) {
+				pos = findClass(begin, end, true);
+				spanning.append(begin, pos);
+			}
+			tokenBegin = spanning.data();
+			length = spanning.size();
+			return true;
+		}
+
+		const char* tokenBegin = nullptr;
+		size_t tokenLength() const { return length; }
+
+	private:
+		bool nextBlock() {
+			size_t size;
+			if(!reader.next(begin, size)) return false;
+			pos = begin;
+			end = begin + size;
+			return true;
+		}
+
+		FileBlockReader reader;
+		const char* begin = nullptr;
+		const char* pos = nullptr;
+		const char* end = nullptr;
+		size_t length = 0;
+		// Token that continues over blocks.
+		string spanning;
+	};
+
+	bool tokensEqual(const TokenReader& a, const TokenReader& b) {
+		return a.tokenLength() == b.tokenLength() &&
+			memcmp(a.tokenBegin, b.tokenBegin, a.tokenLength()) == 0;
+	}
+
+	optional<double> parseNumber(const TokenReader& token) {
+		// Tokens are not null terminated.
+		string str(token.tokenBegin, token.tokenLength());
+		char* parseEnd;
+		double value = strtod(str.c_str(), &parseEnd);
+		if(parseEnd != str.c_str() + str.size() || std::isnan(value)) {
+			return optional<double>();
+		}
+		return value;
+	}
+
+	template <typename Equal>
+	bool compareTokens(const string& outputHash, const string& correctHash, Equal equal) {
+		TokenReader outputReader(outputHash);
+		TokenReader correctReader(correctHash);
+		while(true) {
+			bool outputHasToken = outputReader.next();
+			bool correctHasToken = correctReader.next();
+			if(outputHasToken != correctHasToken) return false;
+			if(!outputHasToken) return true;
+			if(!equal(outputReader, correctReader)) return false;
+		}
+	}
+}
+
+bool compareExact(const string& outputHash, const string& correctHash) {
+	if(outputHash == correctHash) return true;
+	if(fileSizeByHash(outputHash) != fileSizeByHash(correctHash)) return false;
+	// Blocks of the files may have different sizes.
+	FileBlockReader output(outputHash);
+	FileBlockReader correct(correctHash);
+	const char* outputData = nullptr;
+	const char* correctData = nullptr;
+	size_t outputLeft = 0;
+	size_t correctLeft = 0;
+	while(true) {
+		if(outputLeft == 0 && !output.next(outputData, outputLeft)) break;
+		if(correctLeft == 0 && !correct.next(correctData, correctLeft)) return false;
+		size_t length = std::min(outputLeft, correctLeft);
+		if(memcmp(outputData, correctData, length) != 0) return false;
+		outputData += length;
+		correctData += length;
+		outputLeft -= length;
+		correctLeft -= length;
+	}
+	return correctLeft == 0 && !correct.next(correctData, correctLeft);
+}
+
+bool compareIgnoreWhitespace(const string& outputHash, const string& correctHash) {
+	return compareTokens(outputHash, correctHash, tokensEqual);
+}
+
+bool compareFloat(
+	const string& outputHash,
+	const string& correctHash,
+	double absoluteEpsilon,
+	double relativeEpsilon
+) {
+	return compareTokens(outputHash, correctHash,
+		[&](const TokenReader& output, const TokenReader& correct) {
+			if(tokensEqual(output, correct)) return true;
+			optional<double> outputValue = parseNumber(output);
+			optional<double> correctValue = parseNumber(correct);
+			if(!outputValue || !correctValue) return false;
+			double difference = std::fabs(*outputValue - *correctValue);
+			return difference <= absoluteEpsilon ||
+				difference <= relativeEpsilon * std::fabs(*correctValue);
+		});
+}
+
+}
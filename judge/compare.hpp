@@ -0,0 +1,25 @@
+#pragma once
+#include "common.hpp"
+
+namespace cses {
+
+// Built-in comparisons of program output to the correct output, used instead
+// of running an evaluator program. Files are given by hash and must exist in
+// the file store.
+
+// Files must be byte for byte equal.
+bool compareExact(const string& outputHash, const string& correctHash);
+
+// Files must have the same whitespace separated tokens.
+bool compareIgnoreWhitespace(const string& outputHash, const string& correctHash);
+
+// As compareIgnoreWhitespace, but tokens that are both numbers are equal if
+// their absolute or relative difference is within the epsilon.
+bool compareFloat(
+	const string& outputHash,
+	const string& correctHash,
+	double absoluteEpsilon,
+	double relativeEpsilon
+);
+
+}
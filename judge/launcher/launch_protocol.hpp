@@ -0,0 +1,182 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <unistd.h>
+
+// Messages between the judge and the sandbox launcher. A connection carries
+// one request and its result. Messages are sent as a 32-bit length followed
+// by the fields in host byte order, as both ends run on the same host.
+
+namespace cses {
+namespace launch {
+
+struct Request {
+	// Executable to run, in inputDir.
+	std::string program;
+	std::string inputDir;
+	std::string outputDir;
+	// Passed to the program in the environment as RUNSAFE and
+	// ALLOWED_SYSCALLS.
+	std::string runSafe;
+	std::string allowedSyscalls;
+	// Limit of both CPU and wall time.
+	int32_t timeLimitSeconds = 0;
+	// Limit of address space, 0 for unlimited.
+	int64_t memoryBytes = 0;
+	int64_t fileSizeBytes = 0;
+	int32_t processLimit = 0;
+};
+
+struct Result {
+	// False if the program could not be started, error then tells why.
+	bool started = false;
+	std::string error;
+	int32_t exitStatus = 0;
+	// Signal that ended the program, or 0.
+	int32_t signal = 0;
+	bool timedOut = false;
+	double wallSeconds = 0;
+	double cpuSeconds = 0;
+	int64_t maxRssBytes = 0;
+};
+
+const size_t MAX_MESSAGE_SIZE = 1 << 16;
+
+class Writer {
+public:
+	template<typename T>
+	void put(T value) {
+		data.append((const char*)&value, sizeof(value));
+	}
+	void putString(const std::string& s) {
+		put<uint32_t>(s.size());
+		data += s;
+	}
+	std::string data;
+};
+
+// Throws std::runtime_error if the message ends early.
+class Reader {
+public:
+	Reader(const std::string& data) : data(data), position(0) { }
+	template<typename T>
+	T get() {
+		T value;
+		need(sizeof(value));
+		memcpy(&value, data.data() + position, sizeof(value));
+		position += sizeof(value);
+		return value;
+	}
+	std::string getString() {
+		uint32_t size = get<uint32_t>();
+		need(size);
+		std::string s = data.substr(position, size);
+		position += size;
+		return s;
+	}
+private:
+	void need(size_t size) {
+		if(data.size() - position < size) throw std::runtime_error("Truncated launcher message.");
+	}
+	const std::string& data;
+	size_t position;
+};
+
+inline std::string encode(const Request& request) {
+	Writer w;
+	w.putString(request.program);
+	w.putString(request.inputDir);
+	w.putString(request.outputDir);
+	w.putString(request.runSafe);
+	w.putString(request.allowedSyscalls);
+	w.put(request.timeLimitSeconds);
+	w.put(request.memoryBytes);
+	w.put(request.fileSizeBytes);
+	w.put(request.processLimit);
+	return w.data;
+}
+
+inline Request decodeRequest(const std::string& data) {
+	Reader r(data);
+	Request request;
+	request.program = r.getString();
+	request.inputDir = r.getString();
+	request.outputDir = r.getString();
+	request.runSafe = r.getString();
+	request.allowedSyscalls = r.getString();
+	request.timeLimitSeconds = r.get<int32_t>();
+	request.memoryBytes = r.get<int64_t>();
+	request.fileSizeBytes = r.get<int64_t>();
+	request.processLimit = r.get<int32_t>();
+	return request;
+}
+
+inline std::string encode(const Result& result) {
+	Writer w;
+	w.put<uint8_t>(result.started);
+	w.putString(result.error);
+	w.put(result.exitStatus);
+	w.put(result.signal);
+	w.put<uint8_t>(result.timedOut);
+	w.put(result.wallSeconds);
+	w.put(result.cpuSeconds);
+	w.put(result.maxRssBytes);
+	return w.data;
+}
+
+inline Result decodeResult(const std::string& data) {
+	Reader r(data);
+	Result result;
+	result.started = r.get<uint8_t>();
+	result.error = r.getString();
+	result.exitStatus = r.get<int32_t>();
+	result.signal = r.get<int32_t>();
+	result.timedOut = r.get<uint8_t>();
+	result.wallSeconds = r.get<double>();
+	result.cpuSeconds = r.get<double>();
+	result.maxRssBytes = r.get<int64_t>();
+	return result;
+}
+
+// Write or read the whole buffer, returning false on error or end of file.
+inline bool writeAll(int fd, const char* buffer, size_t size) {
+	while(size > 0) {
+		ssize_t count = write(fd, buffer, size);
+		if(count < 0 && errno == EINTR) continue;
+		if(count <= 0) return false;
+		buffer += count;
+		size -= count;
+	}
+	return true;
+}
+inline bool readAll(int fd, char* buffer, size_t size) {
+	while(size > 0) {
+		ssize_t count = read(fd, buffer, size);
+		if(count < 0 && errno == EINTR) continue;
+		if(count <= 0) return false;
+		buffer += count;
+		size -= count;
+	}
+	return true;
+}
+
+inline bool sendMessage(int fd, const std::string& message) {
+	uint32_t size = message.size();
+	return writeAll(fd, (const char*)&size, sizeof(size)) &&
+		writeAll(fd, message.data(), message.size());
+}
+
+// Returns false on error, end of file or a message larger than
+// MAX_MESSAGE_SIZE.
+inline bool receiveMessage(int fd, std::string& message) {
+	uint32_t size;
+	if(!readAll(fd, (char*)&size, sizeof(size)) || size > MAX_MESSAGE_SIZE) return false;
+	message.resize(size);
+	return size == 0 || readAll(fd, &message[0], size);
+}
+
+}
+}
@@ -0,0 +1,348 @@
+/*
+ * Privileged daemon that runs sandboxed programs for the judge. The judge
+ * sends run requests over a Unix socket, and the launcher starts each program
+ * directly with fork and execve as the sandbox user with resource limits,
+ * replacing the sudo, run_boxed.sh and timeout processes of every run.
+ *
+ * Example, as root:
+ * ./launcher -socket /run/cses-launcher.sock -client judge -user judgerun
+ */
+
+#include "launch_protocol.hpp"
+#include <iostream>
+#include <string>
+#include <map>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <vector>
+#include <cmath>
+#include <csignal>
+#include <fcntl.h>
+#include <dirent.h>
+#include <grp.h>
+#include <pwd.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+using namespace std;
+using namespace cses::launch;
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+// Kills the process groups of runs that are still running at their deadline.
+class Watchdog {
+public:
+	Watchdog() : thread(&Watchdog::loop, this) {
+		thread.detach();
+	}
+
+	void add(pid_t pid, Clock::time_point deadline) {
+		unique_lock<mutex> lock(m);
+		deadlines[pid] = deadline;
+		condition.notify_one();
+	}
+
+	// Stop watching the process. Returns whether it was killed.
+	bool remove(pid_t pid) {
+		unique_lock<mutex> lock(m);
+		deadlines.erase(pid);
+		return killed.erase(pid) > 0;
+	}
+
+private:
+	void loop() {
+		unique_lock<mutex> lock(m);
+		while(true) {
+			if(deadlines.empty()) {
+				condition.wait(lock);
+				continue;
+			}
+			auto first = deadlines.begin();
+			for(auto it = deadlines.begin(); it != deadlines.end(); ++it) {
+				if(it->second < first->second) first = it;
+			}
+			if(first->second > Clock::now()) {
+				condition.wait_until(lock, first->second);
+				continue;
+			}
+			kill(-first->first, SIGKILL);
+			killed.insert(first->first);
+			deadlines.erase(first);
+		}
+	}
+
+	mutex m;
+	condition_variable condition;
+	map<pid_t, Clock::time_point> deadlines;
+	set<pid_t> killed;
+	std::thread thread;
+};
+
+Watchdog* watchdog;
+uid_t runUid;
+gid_t runGid;
+uid_t clientUid;
+gid_t clientGid;
+
+// Whether path is a directory of the client, not a symbolic link.
+bool isClientDirectory(const string& path) {
+	struct stat st;
+	return !path.empty() && path[0] == '/' && lstat(path.c_str(), &st) == 0 &&
+		S_ISDIR(st.st_mode) && st.st_uid == clientUid;
+}
+
+// Give the files that the program created to the client. Files with other
+// links are left alone, as they may be links to files of other users.
+void giveToClient(const string& path, int depth) {
+	struct stat st;
+	if(lstat(path.c_str(), &st) != 0) return;
+	if(st.st_uid == runUid && (!S_ISREG(st.st_mode) || st.st_nlink == 1)) {
+		if(lchown(path.c_str(), clientUid, clientGid) != 0) {
+			cerr << "lchown " << path << " failed: " << strerror(errno) << "\n";
+		}
+	}
+	const int MAX_DEPTH = 16;
+	if(!S_ISDIR(st.st_mode) || depth == MAX_DEPTH) return;
+	DIR* dir = opendir(path.c_str());
+	if(!dir) return;
+	vector<string> names;
+	while(struct dirent* ent = readdir(dir)) {
+		string name = ent->d_name;
+		if(name != "." && name != "..") names.push_back(name);
+	}
+	closedir(dir);
+	for(const string& name : names) {
+		giveToClient(path + "/" + name, depth + 1);
+	}
+}
+
+void setLimit(int resource, rlim_t soft, rlim_t hard) {
+	struct rlimit limit;
+	limit.rlim_cur = soft;
+	limit.rlim_max = hard;
+	setrlimit(resource, &limit);
+}
+
+// Start the program in a new process group as the sandbox user. Only
+// async-signal-safe calls are made between fork and execve.
+void runProgram(const Request& request, Result& result) {
+	vector<string> env = {
+		"IN=" + request.inputDir,
+		"OUT=" + request.outputDir,
+		"RUNSAFE=" + request.runSafe,
+		"ALLOWED_SYSCALLS=" + request.allowedSyscalls,
+		"PATH=/usr/local/bin:/usr/bin:/bin",
+	};
+	vector<char*> envp;
+	for(string& s : env) envp.push_back(&s[0]);
+	envp.push_back(nullptr);
+	string program = request.program;
+	char* argv[] = {&program[0], nullptr};
+
+	// The child reports a failure to start through the pipe, which closes
+	// on a successful execve.
+	int errorPipe[2];
+	if(pipe2(errorPipe, O_CLOEXEC) != 0) {
+		result.error = string("pipe2 failed: ") + strerror(errno);
+		return;
+	}
+	// The program must not get the standard streams of the daemon.
+	int devNull = open("/dev/null", O_RDWR | O_CLOEXEC);
+	if(devNull < 0) {
+		result.error = string("opening /dev/null failed: ") + strerror(errno);
+		close(errorPipe[0]);
+		close(errorPipe[1]);
+		return;
+	}
+	auto start = Clock::now();
+	pid_t pid = fork();
+	if(pid < 0) {
+		result.error = string("fork failed: ") + strerror(errno);
+		close(errorPipe[0]);
+		close(errorPipe[1]);
+		close(devNull);
+		return;
+	}
+	if(pid == 0) {
+		close(errorPipe[0]);
+		for(int fd = 0; fd <= 2; ++fd) dup2(devNull, fd);
+		setpgid(0, 0);
+		rlim_t cpu = request.timeLimitSeconds;
+		setLimit(RLIMIT_CPU, cpu, cpu + 1);
+		if(request.memoryBytes) setLimit(RLIMIT_AS, request.memoryBytes, request.memoryBytes);
+		setLimit(RLIMIT_NPROC, request.processLimit, request.processLimit);
+		setLimit(RLIMIT_FSIZE, request.fileSizeBytes, request.fileSizeBytes);
+		setLimit(RLIMIT_STACK, RLIM_INFINITY, RLIM_INFINITY);
+		int error = 0;
+		if(chdir(request.outputDir.c_str()) != 0 ||
+			setgroups(0, nullptr) != 0 ||
+			setgid(runGid) != 0 ||
+			setuid(runUid) != 0)
+		{
+			error = errno;
+		} else {
+			execve(argv[0], argv, envp.data());
+			error = errno;
+		}
+		if(write(errorPipe[1], &error, sizeof(error)) < 0) { }
+		_exit(127);
+	}
+	close(errorPipe[1]);
+	close(devNull);
+	watchdog->add(pid, start + chrono::seconds(request.timeLimitSeconds));
+	int error = 0;
+	bool failed = readAll(errorPipe[0], (char*)&error, sizeof(error));
+	close(errorPipe[0]);
+
+	// Wait without reaping, so that the watchdog can't kill a reused pid.
+	siginfo_t info;
+	while(waitid(P_PID, pid, &info, WEXITED | WNOWAIT) != 0 && errno == EINTR) { }
+	result.timedOut = watchdog->remove(pid);
+	result.wallSeconds = chrono::duration<double>(Clock::now() - start).count();
+	// Processes left behind by the program. The group is killed while the
+	// unreaped leader still keeps its id from being reused.
+	kill(-pid, SIGKILL);
+	int status = 0;
+	struct rusage usage;
+	while(wait4(pid, &status, 0, &usage) < 0 && errno == EINTR) { }
+
+	if(failed) {
+		result.error = string("starting program failed: ") + strerror(error);
+		return;
+	}
+	result.started = true;
+	if(WIFEXITED(status)) result.exitStatus = WEXITSTATUS(status);
+	if(WIFSIGNALED(status)) result.signal = WTERMSIG(status);
+	result.cpuSeconds =
+		usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+		usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+	result.maxRssBytes = (int64_t)usage.ru_maxrss * 1024;
+}
+
+void handleConnection(int fd) {
+	string message;
+	if(!receiveMessage(fd, message)) {
+		close(fd);
+		return;
+	}
+	Result result;
+	try {
+		Request request = decodeRequest(message);
+		const string& in = request.inputDir;
+		const string& program = request.program;
+		if(!isClientDirectory(in) || !isClientDirectory(request.outputDir)) {
+			result.error = "Run directories must be directories of the judge.";
+		} else if(program.compare(0, in.size() + 1, in + "/") != 0 ||
+			program.find("/", in.size() + 1) != string::npos)
+		{
+			result.error = "Program must be in the input directory.";
+		} else if(request.timeLimitSeconds <= 0 || request.processLimit <= 0 ||
+			request.fileSizeBytes < 0 || request.memoryBytes < 0)
+		{
+			result.error = "Invalid limits.";
+		} else {
+			if(lchown(request.outputDir.c_str(), runUid, runGid) != 0) {
+				result.error = string("lchown failed: ") + strerror(errno);
+			} else {
+				runProgram(request, result);
+				giveToClient(request.outputDir, 0);
+			}
+		}
+	} catch(const exception& e) {
+		result.error = e.what();
+	}
+	if(!result.error.empty()) cerr << "Run failed: " << result.error << "\n";
+	sendMessage(fd, encode(result));
+	close(fd);
+}
+
+bool lookupUser(const string& name, uid_t& uid, gid_t& gid) {
+	struct passwd* pw = getpwnam(name.c_str());
+	if(!pw) return false;
+	uid = pw->pw_uid;
+	gid = pw->pw_gid;
+	return true;
+}
+
+}
+
+int main(int argc, char** argv) {
+	string socketPath = "launcher.sock";
+	string runUser = "judgerun";
+	string clientUser;
+	for(int i = 1; i < argc; ++i) {
+		string s = argv[i];
+		if(s == "-socket" && i + 1 < argc) {
+			socketPath = argv[++i];
+		} else if(s == "-user" && i + 1 < argc) {
+			runUser = argv[++i];
+		} else if(s == "-client" && i + 1 < argc) {
+			clientUser = argv[++i];
+		} else {
+			cerr << "Unknown argument " << s << "\n";
+			return 1;
+		}
+	}
+	if(clientUser.empty()) {
+		cerr << "Give the user of the judge with -client USER.\n";
+		return 1;
+	}
+	if(!lookupUser(runUser, runUid, runGid) || !lookupUser(clientUser, clientUid, clientGid)) {
+		cerr << "Unknown user.\n";
+		return 1;
+	}
+	if(runUid == 0) {
+		cerr << "Programs must not be run as root.\n";
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if(socketPath.size() >= sizeof(address.sun_path)) {
+		cerr << "Socket path too long.\n";
+		return 1;
+	}
+	strcpy(address.sun_path, socketPath.c_str());
+	unlink(socketPath.c_str());
+	// Only the judge may connect.
+	if(listener < 0 ||
+		bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+		chown(socketPath.c_str(), clientUid, clientGid) != 0 ||
+		chmod(socketPath.c_str(), 0600) != 0 ||
+		listen(listener, 64) != 0)
+	{
+		cerr << "Listening on " << socketPath << " failed: " << strerror(errno) << "\n";
+		return 1;
+	}
+	watchdog = new Watchdog();
+	cerr << "Launching programs as " << runUser << " for " << clientUser << "\n";
+
+	while(true) {
+		int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+		if(fd < 0) {
+			if(errno != EINTR) cerr << "accept failed: " << strerror(errno) << "\n";
+			continue;
+		}
+		struct ucred peer;
+		socklen_t length = sizeof(peer);
+		if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) != 0 ||
+			(peer.uid != clientUid && peer.uid != 0))
+		{
+			close(fd);
+			continue;
+		}
+		std::thread(handleConnection, fd).detach();
+	}
+}
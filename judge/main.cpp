@@ -1,8 +1,12 @@
 #include "common.hpp"
+#include "io_util.hpp"
 #include "Judge.hpp"
+#include "file.hpp"
+#include <thread>
 #include <thrift/concurrency/ThreadManager.h>
 #include <thrift/concurrency/PosixThreadFactory.h>
 #include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/server/TNonblockingServer.h>
 #include <thrift/server/TThreadPoolServer.h>
 #include <thrift/server/TThreadedServer.h>
 #include <thrift/transport/TServerSocket.h>
@@ -10,7 +14,78 @@
 
 using namespace cses;
 
-int main() {
+const int PORT = 9090;
+
+int main(int argc, char** argv) {
+	// Half of the processors by default, so that concurrent runs don't
+	// disturb each other's timing.
+	int slotCount = std::max(1u, std::thread::hardware_concurrency() / 2);
+	// Maximum total size of stored files, 0 for unlimited.
+	int64_t cacheBytes = 0;
+	// Directory for staged inputs, preferably on tmpfs. Empty disables.
+	string stagingDirectory;
+	int64_t stagingBytes = 1 << 30;
+	// Socket of the sandbox launcher daemon. Empty runs ptrace sandboxes
+	// with sudo and run_boxed.sh.
+	string launcherSocket;
+	// Threads executing calls, 0 for slot count plus spare threads for
+	// calls that don't run programs. The threadpool server needs at least
+	// a thread for each connection of the web server.
+	int threadCount = 0;
+	// "nonblocking" reads calls with one I/O thread and executes them in
+	// the thread pool. "threadpool" dedicates a thread to each connection.
+	string serverType = "nonblocking";
+	for(int i = 1; i < argc; ++i) {
+		string s = argv[i];
+		if(s == "-slots" && i + 1 < argc) {
+			optional<int> value = stringToInteger<int>(argv[++i]);
+			if(!value || *value < 1) {
+				cerr << "Invalid slot count " << argv[i] << "\n";
+				return 1;
+			}
+			slotCount = *value;
+		} else if(s == "-cache-bytes" && i + 1 < argc) {
+			optional<int64_t> value = stringToInteger<int64_t>(argv[++i]);
+			if(!value || *value < 0) {
+				cerr << "Invalid cache size " << argv[i] << "\n";
+				return 1;
+			}
+			cacheBytes = *value;
+		} else if(s == "-staging" && i + 1 < argc) {
+			stagingDirectory = argv[++i];
+		} else if(s == "-staging-bytes" && i + 1 < argc) {
+			optional<int64_t> value = stringToInteger<int64_t>(argv[++i]);
+			if(!value || *value < 0) {
+				cerr << "Invalid staging size " << argv[i] << "\n";
+				return 1;
+			}
+			stagingBytes = *value;
+		} else if(s == "-launcher" && i + 1 < argc) {
+			launcherSocket = argv[++i];
+		} else if(s == "-threads" && i + 1 < argc) {
+			optional<int> value = stringToInteger<int>(argv[++i]);
+			if(!value || *value < 1) {
+				cerr << "Invalid thread count " << argv[i] << "\n";
+				return 1;
+			}
+			threadCount = *value;
+		} else if(s == "-server" && i + 1 < argc) {
+			serverType = argv[++i];
+			if(serverType != "nonblocking" && serverType != "threadpool") {
+				cerr << "Unknown server type " << serverType << "\n";
+				return 1;
+			}
+		} else if(s == "-compress") {
+			setFileCompression(true);
+		} else if(s == "-migrate-files") {
+			int moved = migrateFileStore();
+			cerr << "Moved " << moved << " files to the sharded layout.\n";
+			return 0;
+		} else {
+			cerr << "Unknown argument " << s << "\n";
+		}
+	}
+	
 	using namespace apache::thrift;
 	using namespace apache::thrift::protocol;
 	using namespace apache::thrift::transport;
@@ -18,25 +93,50 @@ int main() {
 	using namespace apache::thrift::server;
 	
 	boost::shared_ptr<TProtocolFactory> protocolFactory(new TBinaryProtocolFactory());
-	boost::shared_ptr<Judge> judge(new Judge("uolevi"));
+	boost::shared_ptr<Judge> judge(new Judge(
+		"uolevi", slotCount, cacheBytes, stagingDirectory, stagingBytes, launcherSocket));
 	boost::shared_ptr<TProcessor> processor(new cses::protocol::JudgeProcessor(judge));
-	boost::shared_ptr<TServerTransport> serverTransport(new TServerSocket(9090));
-	boost::shared_ptr<TTransportFactory> transportFactory(new TBufferedTransportFactory());
 	
+	// Runs wait for a slot while holding their thread, so cheap calls need
+	// threads beyond the slots to not queue behind runs.
+	const int SPARE_THREADS = 8;
+	if(serverType == "threadpool") {
+		// A connection holds its thread while open, and the web server opens
+		// up to two for each slot and one for polling status. Connections
+		// beyond the threads would wait without an answer.
+		int minThreadCount = 2 * slotCount + 1 + SPARE_THREADS;
+		if(threadCount != 0 && threadCount < minThreadCount) {
+			cerr << "Using " << minThreadCount << " threads instead of " << threadCount
+				<< ", as each connection holds a thread.\n";
+		}
+		threadCount = std::max(threadCount, minThreadCount);
+	}
+	if(threadCount == 0) threadCount = slotCount + SPARE_THREADS;
+	if(threadCount <= slotCount) {
+		cerr << "Warning: with " << threadCount << " threads for " << slotCount
+			<< " slots, calls may wait for runs to finish.\n";
+	}
 	boost::shared_ptr<ThreadManager> threadManager =
-		ThreadManager::newSimpleThreadManager(16);
+		ThreadManager::newSimpleThreadManager(threadCount);
 	boost::shared_ptr<PosixThreadFactory> threadFactory =
 		boost::shared_ptr<PosixThreadFactory>(new PosixThreadFactory());
 	threadManager->threadFactory(threadFactory);
 	threadManager->start();
 	
-	TThreadPoolServer server(
-		processor,
-		serverTransport,
-		transportFactory,
-		protocolFactory,
-		threadManager
-	);
-	
-	server.serve();
+	// Both server types use framed transport, as the web server does.
+	if(serverType == "nonblocking") {
+		TNonblockingServer server(processor, protocolFactory, PORT, threadManager);
+		server.serve();
+	} else {
+		boost::shared_ptr<TServerTransport> serverTransport(new TServerSocket(PORT));
+		boost::shared_ptr<TTransportFactory> transportFactory(new TFramedTransportFactory());
+		TThreadPoolServer server(
+			processor,
+			serverTransport,
+			transportFactory,
+			protocolFactory,
+			threadManager
+		);
+		server.serve();
+	}
 }
@@ -174,20 +174,18 @@ void runDocker(
 	const string& imageRepository,
 	const string& imageID,
 	const vector<protocol::FileRef>& inputs,
-	const protocol::RunOptions& options
+	const protocol::RunOptions& options,
+	StagingArea& staging
 ) {
 	checkRunParameters(imageRepository, imageID, inputs, options);
 	
 	ensureImagePulled(imageRepository, imageID);
 	
 	// Create input and output directories.
-	mkdir("tmp", 0700);
-	
 	auto tmpdirFail = []() { throw Error("Could not create temporary directories."); };
 	
-	char tmpdirnameBuf[] = "tmp/XXXXXX";
-	if(mkdtemp(tmpdirnameBuf) == nullptr) tmpdirFail();
-	string tmpdirname = tmpdirnameBuf;
+	string tmpdirname = staging.tempRoot() + "/XXXXXX";
+	if(mkdtemp(&tmpdirname[0]) == nullptr) tmpdirFail();
 	
 	string indirName = tmpdirname + "/in";
 	if(mkdir(indirName.c_str(), 0700) == -1) tmpdirFail();
@@ -197,11 +195,7 @@ void runDocker(
 	
 	// Hardlink input files.
 	for(const protocol::FileRef& input : inputs) {
-		string from = getFileStoragePath(input.hash);
-		string to = indirName + "/" + input.name;
-		if(link(from.c_str(), to.c_str()) == -1) {
-			throw Error("Could not hardlink input file.");
-		}
+		staging.link(input.hash, indirName + "/" + input.name);
 	}
 	
 	runCommand("chmod -R 777 " + tmpdirname);
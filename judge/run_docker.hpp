@@ -1,5 +1,6 @@
 #include "common.hpp"
 #include "gen-cpp/Judge.h"
+#include "StagingArea.hpp"
 
 namespace cses {
 void runDocker(
@@ -7,5 +8,6 @@ void runDocker(
 	const string& imageRepository,
 	const string& imageID,
 	const vector<protocol::FileRef>& inputs,
-	const protocol::RunOptions& options);
+	const protocol::RunOptions& options,
+	StagingArea& staging);
 }
@@ -4,8 +4,13 @@
 #include "common/file.hpp"
 #include "gen-cpp/Judge.h"
 #include <cmath>
+#include <cerrno>
+#include <dirent.h>
+#include <spawn.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 
 namespace {
 using namespace std;
@@ -31,6 +36,70 @@ void pathPermissions(string path, string per) {
 	}
 }
 
+// Let other users search the directories leading to path.
+void allowTraversal(string path) {
+	while(true) {
+		size_t idx = path.find_last_of('/');
+		if(idx == string::npos || idx == 0) break;
+		path = path.substr(0, idx);
+		struct stat st;
+		if(stat(path.c_str(), &st) == 0 && !(st.st_mode & S_IXOTH)) {
+			chmod(path.c_str(), (st.st_mode & 07777) | S_IXOTH);
+		}
+	}
+}
+
+// Let the sandbox user read and execute the inputs. Uses system calls
+// instead of chmod processes, as this is done for every run.
+void allowInputAccess(const string& dir) {
+	allowTraversal(dir);
+	chmod(dir.c_str(), 0755);
+	DIR* d = opendir(dir.c_str());
+	if(d == nullptr) throw cses::Error("Opening sandbox input directory failed.");
+	while(struct dirent* ent = readdir(d)) {
+		if(ent->d_type != DT_REG) continue;
+		chmod((dir + "/" + ent->d_name).c_str(), 0755);
+	}
+	closedir(d);
+}
+
+// Environment of the judge with the given variables set.
+vector<string> runEnvironment(const vector<pair<string, string>>& vars) {
+	vector<string> env;
+	for(char** e = environ; *e != nullptr; ++e) {
+		string entry = *e;
+		string name = entry.substr(0, entry.find('='));
+		bool replaced = false;
+		for(const auto& var : vars) {
+			if(var.first == name) replaced = true;
+		}
+		if(!replaced) env.push_back(entry);
+	}
+	for(const auto& var : vars) {
+		env.push_back(var.first + "=" + var.second);
+	}
+	return env;
+}
+
+// Run the command with the environment and wait for it to finish. Returns
+// the wait status, or -1 if the command could not be started. Unlike
+// system, this doesn't need the variables in the shared process environment.
+int runProcess(vector<string> args, vector<string> env) {
+	vector<char*> argv;
+	for(string& arg : args) argv.push_back(&arg[0]);
+	argv.push_back(nullptr);
+	vector<char*> envp;
+	for(string& var : env) envp.push_back(&var[0]);
+	envp.push_back(nullptr);
+	pid_t pid;
+	if(posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), envp.data()) != 0) return -1;
+	int status;
+	while(waitpid(pid, &status, 0) == -1) {
+		if(errno != EINTR) return -1;
+	}
+	return status;
+}
+
 double getTime() {
 	struct timeval t;
 	gettimeofday(&t, nullptr);
@@ -45,51 +114,81 @@ void runPTrace(
 	protocol::RunResult& _return,
 	const protocol::PTraceConfig& config,
 	const vector<protocol::FileRef>& inputs,
-	const protocol::RunOptions& options
+	const protocol::RunOptions& options,
+	StagingArea& staging,
+	Launcher& launcher,
+	int concurrentRuns
 ) {
-	TempDir inputDir;
-	TempDir outputDir;
+	TempDir inputDir(staging);
+	TempDir outputDir(staging);
 
 	inputDir.hardlinkInputs(inputs);
 
-	// FIXME: this is not thread safe
-	cerr<<"Calling setenv "<<inputDir.getName()<<' '<<outputDir.getName()<<'\n';
-	setenv("IN", inputDir.getName().c_str(), true);
-	setenv("OUT", outputDir.getName().c_str(), true);
-	string runSafe = programPath + "/" + RESTRICT_SYSCALLS;
-	setenv("RUNSAFE", runSafe.c_str(), true);
-	setenv("ALLOWED_SYSCALLS", config.allowedSyscalls.c_str(), true);
-
 	using protocol::SyscallPolicy;
 	SyscallPolicy::type policy = config.policy;
 	string type = policy == SyscallPolicy::NO_RESTRICT ? "NONE"
 		: policy == SyscallPolicy::PTRACE ? "PTRACE"
 		: policy == SyscallPolicy::SECCOMP ? "SECCOMP"
 		: throw withMsg<protocol::InvalidDataError>("Unknown syscall restrict policy");
-	char buf[4096];
 	long long spaceKiB = 4096;
-	string runScript = getFileStoragePath(config.runnerHash);
-	cerr<<"runscript "<<runScript<<'\n';
-	link(runScript.c_str(), (inputDir.getName() + "/__run").c_str());
-//	sprintf(buf, "sudo %s/%s %d %lld %lld %s/%s -type \"%s\" -allowed \"%s\" \"%s\"",
-	sprintf(buf, "sudo -E -u judgerun %s/%s %d %lld %lld \"%s/__run\"",
-		programPath.c_str(),
-		RUN_BOXED.c_str(),
-		int(ceil(options.timeLimit)),
-		options.memoryLimitBytes / 1024LL,
-		spaceKiB,
-		inputDir.getName().c_str());
+	// The limit is per user, and concurrent runs share the sandbox user.
+	int processLimit = (options.memoryLimitBytes != 0 ? 10 : 1000) * concurrentRuns;
+	string runSafe = programPath + "/" + RESTRICT_SYSCALLS;
+	cerr<<"runscript "<<config.runnerHash<<'\n';
+	staging.link(config.runnerHash, inputDir.getName() + "/__run");
+
+	if(launcher.enabled()) {
+		allowInputAccess(inputDir.getName());
+		launch::Request request;
+		request.program = inputDir.getName() + "/__run";
+		request.inputDir = inputDir.getName();
+		request.outputDir = outputDir.getName();
+		request.runSafe = runSafe;
+		request.allowedSyscalls = config.allowedSyscalls;
+		request.timeLimitSeconds = int(ceil(options.timeLimit));
+		request.memoryBytes = options.memoryLimitBytes / 1024 * 1024;
+		request.fileSizeBytes = spaceKiB * 1024;
+		request.processLimit = processLimit;
+		launch::Result result = launcher.run(request);
+		_return.timeInSeconds = result.wallSeconds;
+		_return.memoryInBytes = result.maxRssBytes;
+		if(!result.started) {
+			// Not a fault of the program, so the run is retried elsewhere.
+			throw withMsg<protocol::InternalError>("Launching runner failed: " + result.error);
+		}
+		outputDir.saveContents("", _return);
+		return;
+	}
+
+	// Each run gets its own environment, so that runs can execute
+	// concurrently.
+	cerr<<"Run environment "<<inputDir.getName()<<' '<<outputDir.getName()<<'\n';
+	vector<string> env = runEnvironment({
+		{"IN", inputDir.getName()},
+		{"OUT", outputDir.getName()},
+		{"RUNSAFE", runSafe},
+		{"ALLOWED_SYSCALLS", config.allowedSyscalls},
+		{"PROCESS_LIMIT", std::to_string(processLimit)},
+	});
+	vector<string> args = {
+		"sudo", "-E", "-u", "judgerun",
+		programPath + "/" + RUN_BOXED,
+		std::to_string(int(ceil(options.timeLimit))),
+		std::to_string(options.memoryLimitBytes / 1024LL),
+		std::to_string(spaceKiB),
+		inputDir.getName() + "/__run",
+	};
 	cerr<<"Setting permissions for "<<inputDir.getName()<<" "<<outputDir.getName()<<'\n';
 	pathPermissions(inputDir.getName(), "777");
 	system(("chmod -R 777 " + inputDir.getName()).c_str());
 	pathPermissions(outputDir.getName(), "777");
 	system(("chmod -R 777 " + outputDir.getName()).c_str());
-	cerr<<"Running: "<<buf<<'\n';
+	cerr<<"Running "<<RUN_BOXED<<" for "<<inputDir.getName()<<'\n';
 	double startT = getTime();
-	int res = system(buf);
+	int res = runProcess(args, env);
 	_return.timeInSeconds = getTime() - startT;
 	if(res == -1) {
-		throw Error("runCommand: Calling system failed.");
+		throw Error("runPTrace: Starting sudo failed.");
 	}
 	int retval = WEXITSTATUS(res);
 	if (retval != 0) {
@@ -1,10 +1,15 @@
 #pragma once
 #include "common.hpp"
 #include "gen-cpp/Judge.h"
+#include "StagingArea.hpp"
+#include "Launcher.hpp"
 namespace cses {
 void runPTrace(
 	protocol::RunResult& _return,
 	const protocol::PTraceConfig& config,
 	const vector<protocol::FileRef>& inputs,
-	const protocol::RunOptions& options);
+	const protocol::RunOptions& options,
+	StagingArea& staging,
+	Launcher& launcher,
+	int concurrentRuns);
 }
@@ -1,6 +1,7 @@
 #!/bin/bash
 # Usage: ./run_boxed.sh <time> <memory> <space-limit> <program> [program args]
 # NOTE: This should be run as the user who runs the program.
+# PROCESS_LIMIT overrides the limit of processes of the user.
 
 t=$1
 mem=$2
@@ -10,7 +11,7 @@ prog=$4
 echo dirs: $IN $OUT
 cd "$OUT"
 ulimit -t $t
-if [ $mem != 0 ]; then ulimit -u 10 -v $mem; else ulimit -u 1000; fi
+if [ $mem != 0 ]; then ulimit -u ${PROCESS_LIMIT:-10} -v $mem; else ulimit -u ${PROCESS_LIMIT:-1000}; fi
 ulimit -f $space
 ulimit -s unlimited
 echo timeout $t ${@:4}
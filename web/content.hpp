@@ -363,12 +363,22 @@ struct TaskPage: InContestPage {
 		builder.add(t.name, "Name")
 			.add(t.timeInSeconds, "Time (s)")
 			.add(t.memoryInBytes, "Memory (B)")
+			.add(makeEnumSelectProvider(t.checker, "Checker", {
+				{"Evaluator program", CheckerType::CUSTOM},
+				{"Exact", CheckerType::EXACT},
+				{"Ignore whitespace", CheckerType::IGNORE_WHITESPACE},
+				{"Floating point", CheckerType::FLOAT}}))
+			.add(t.absoluteEpsilon, "Absolute epsilon")
+			.add(t.relativeEpsilon, "Relative epsilon")
+			.addProvider<CheckboxProvider, bool>(t.stopOnFirstFailure, "Stop on first failure")
 			.addProvider<FileUploadProvider<MaybeFile>>(e.source, "Evaluator source")
 			.add(makeSelectProvider(e.language, "Evaluator language", choises))
 			.addSubmit();
 		name = t.name;
+		id = t.id;
 	}
 	string name;
+	ID id;
 	string compileMessage;
 
 	cppcms::form form;
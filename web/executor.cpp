@@ -0,0 +1,119 @@
+#include "executor.hpp"
+
+namespace cses {
+
+Executor::Executor(size_t threadCount) {
+	for(size_t i = 0; i < threadCount; ++i) {
+		threads.emplace_back(&Executor::workerLoop, this);
+	}
+}
+
+Executor::~Executor() {
+	shutdown();
+}
+
+void Executor::submit(Job job) {
+	std::unique_lock<std::mutex> lock(mutex);
+	if(stopping) throw Error("Executor::submit: Executor has been shut down.");
+	jobs.push_back(move(job));
+	condition.notify_one();
+}
+
+void Executor::shutdown() {
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if(stopping) return;
+		stopping = true;
+		jobs.clear();
+		condition.notify_all();
+	}
+	for(std::thread& thread : threads) {
+		thread.join();
+	}
+}
+
+void Executor::workerLoop() {
+	while(true) {
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			condition.wait(lock, [&]() { return stopping || !jobs.empty(); });
+			if(stopping) return;
+			job = move(jobs.front());
+			jobs.pop_front();
+		}
+		try {
+			job();
+		} catch(const std::exception& e) {
+			cerr << "Executor job exception: " << e.what() << "\n";
+		} catch(...) {
+			cerr << "Unknown executor job exception\n";
+		}
+	}
+}
+
+TimerWheel::TimerWheel(
+	Executor& executor,
+	std::chrono::milliseconds tick,
+	size_t slotCount
+)
+	: executor(executor),
+	  tick(tick),
+	  slots(slotCount),
+	  thread(&TimerWheel::tickLoop, this)
+{ }
+
+TimerWheel::~TimerWheel() {
+	shutdown();
+}
+
+void TimerWheel::schedule(std::chrono::milliseconds delay, Executor::Job job) {
+	size_t ticks = (delay.count() + tick.count() - 1) / tick.count();
+	if(ticks == 0) ticks = 1;
+
+	std::unique_lock<std::mutex> lock(mutex);
+	Timer timer;
+	timer.rounds = (ticks - 1) / slots.size();
+	timer.job = move(job);
+	slots[(current + ticks) % slots.size()].push_back(move(timer));
+}
+
+void TimerWheel::shutdown() {
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if(stopping) return;
+		stopping = true;
+		condition.notify_all();
+	}
+	thread.join();
+}
+
+void TimerWheel::tickLoop() {
+	std::unique_lock<std::mutex> lock(mutex);
+	auto nextTick = std::chrono::steady_clock::now() + tick;
+	while(true) {
+		if(condition.wait_until(lock, nextTick, [&]() { return stopping; })) {
+			return;
+		}
+		nextTick += tick;
+		current = (current + 1) % slots.size();
+
+		vector<Timer>& slot = slots[current];
+		vector<Timer> waiting;
+		for(Timer& timer : slot) {
+			if(timer.rounds == 0) {
+				try {
+					executor.submit(move(timer.job));
+				} catch(const Error&) {
+					// Executor is shutting down, drop the timer.
+				}
+			} else {
+				--timer.rounds;
+				waiting.push_back(move(timer));
+			}
+		}
+		slot.swap(waiting);
+	}
+}
+
+}
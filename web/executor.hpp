@@ -0,0 +1,68 @@
+#pragma once
+#include "common.hpp"
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+
+namespace cses {
+
+// Fixed number of worker threads executing submitted jobs in FIFO order.
+class Executor {
+public:
+	typedef std::function<void()> Job;
+
+	Executor(size_t threadCount);
+	~Executor();
+
+	void submit(Job job);
+
+	// Stop accepting jobs, drop the ones not yet started and wait for the
+	// running ones to finish.
+	void shutdown();
+
+private:
+	void workerLoop();
+
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::deque<Job> jobs;
+	bool stopping = false;
+	vector<std::thread> threads;
+};
+
+// Hashed timer wheel with fixed tick length. Scheduled jobs are submitted to
+// the executor after their delay, rounded up to whole ticks, has passed.
+class TimerWheel {
+public:
+	TimerWheel(Executor& executor, std::chrono::milliseconds tick, size_t slotCount);
+	~TimerWheel();
+
+	void schedule(std::chrono::milliseconds delay, Executor::Job job);
+
+	// Stop the wheel, dropping all pending timers.
+	void shutdown();
+
+private:
+	struct Timer {
+		// Number of full turns of the wheel left before the timer fires.
+		size_t rounds;
+		Executor::Job job;
+	};
+
+	void tickLoop();
+
+	Executor& executor;
+	std::chrono::milliseconds tick;
+	vector<vector<Timer>> slots;
+	size_t current = 0;
+
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool stopping = false;
+	std::thread thread;
+};
+
+}
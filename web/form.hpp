@@ -75,6 +75,31 @@ struct SelectProvider: WidgetProvider {
 	vector<pair<string, shared_ptr<T>>> choises;
 };
 
+template<class E>
+struct EnumSelectProvider: WidgetProvider {
+	ws::base_widget& getWidget() override {
+		for(const auto& i: choises) widget.add(i.first, std::to_string((int)i.second));
+		widget.selected_id(std::to_string((int)ref));
+		return widget;
+	}
+	void readWidget() override {
+		optional<int> id = stringToInteger<int>(widget.selected_id());
+		if (!id) return;
+		for(const auto& i: choises) {
+			if (*id == (int)i.second) ref = i.second;
+		}
+	}
+
+	EnumSelectProvider(E& v, const string& name, vector<pair<string,E>> choises):
+		ref(v), choises(choises)
+	{
+		widget.message(name);
+	}
+	ws::select widget;
+	E& ref;
+	vector<pair<string, E>> choises;
+};
+
 struct CheckboxProvider: WidgetProvider {
 	ws::base_widget& getWidget() override {
 		widget.value(ref);
@@ -102,6 +127,11 @@ unique_ptr<SelectProvider<T,Ptr>> makeSelectProvider(Ptr& v, const string& name,
 	return makeUnique<SelectProvider<T,Ptr>>(v,name,choises);
 }
 
+template<class E>
+unique_ptr<EnumSelectProvider<E>> makeEnumSelectProvider(E& v, const string& name, vector<pair<string,E>> choises) {
+	return makeUnique<EnumSelectProvider<E>>(v,name,choises);
+}
+
 template<class T>
 struct DefaultWidgetProvider;
 
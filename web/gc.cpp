@@ -0,0 +1,61 @@
+#include "gc.hpp"
+#include "model.hpp"
+#include "common/file.hpp"
+#include <ctime>
+
+namespace cses {
+
+namespace {
+	// Files younger than this are never removed, as they may be about to be
+	// referenced by objects that are not yet persisted, for example outputs
+	// of ongoing judging.
+	const time_t GRACE_PERIOD = 24 * 60 * 60;
+	
+	template <typename View>
+	void markFiles(std::unordered_set<string>& marked) {
+		odb::result<View> result = db::query<View>();
+		for(const View& view : result) {
+			for(const string& hash : view.hashes()) {
+				if(!hash.empty()) marked.insert(hash);
+			}
+		}
+	}
+}
+
+int collectGarbage() {
+	// List files before marking, so that files stored during marking are
+	// not considered.
+	vector<StoredFileEntry> stored = listStoredFiles();
+	time_t cutoff = time(nullptr) - GRACE_PERIOD;
+	
+	std::unordered_set<string> marked;
+	{
+		odb::transaction t(db::begin());
+		markFiles<TestCaseFiles>(marked);
+		markFiles<SubmissionFiles>(marked);
+		markFiles<ResultFiles>(marked);
+		markFiles<RunMemoFiles>(marked);
+		markFiles<CompileCacheFiles>(marked);
+		markFiles<TaskFiles>(marked);
+		markFiles<SubmissionLanguageFiles>(marked);
+		markFiles<EvaluatorLanguageFiles>(marked);
+		t.commit();
+	}
+	
+	int removed = 0;
+	int64_t freed = 0;
+	int64_t kept = 0;
+	for(const StoredFileEntry& file : stored) {
+		if(marked.count(file.hash) || file.modified >= cutoff) {
+			kept += file.bytes;
+			continue;
+		}
+		freed += removeStoredFile(file.hash);
+		++removed;
+	}
+	cerr << "Garbage collection: " << marked.size() << " files referenced, removed "
+		<< removed << " files (" << freed << " bytes), kept " << kept << " bytes\n";
+	return removed;
+}
+
+}
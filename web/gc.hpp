@@ -0,0 +1,10 @@
+#pragma once
+#include "common.hpp"
+
+namespace cses {
+
+// Remove stored files that are not referenced by the database and have not
+// been stored or used recently. Returns the number of files removed.
+int collectGarbage();
+
+}
@@ -10,7 +10,7 @@ Import::~Import() {
 }
 	
 void Import::process(std::istream &zipData) {
-	string fileName = getFileStoragePath(saveStreamToFile(zipData));
+	string fileName = materializeFile(saveStreamToFile(zipData));
 	
 	char tempName[] = "zipXXXXXX";
 	mkdtemp(tempName);
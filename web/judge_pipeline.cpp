@@ -0,0 +1,457 @@
+#include "judge_pipeline.hpp"
+#include <thread>
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+namespace cses {
+
+using apache::thrift::transport::TTransportException;
+
+// Waits for events of all pipelined connections in one thread. Never
+// destroyed, as connections may outlive other static objects.
+class PipelineLoop {
+public:
+	static PipelineLoop& instance() {
+		static PipelineLoop* loop = new PipelineLoop();
+		return *loop;
+	}
+
+	void add(shared_ptr<PipelinedJudgeClient> client, int fd, bool writing) {
+		std::unique_lock<std::mutex> lock(mutex);
+		clients[fd] = client;
+		epoll_event event = makeEvent(fd, writing);
+		if(epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &event) != 0) {
+			clients.erase(fd);
+			throw TTransportException(TTransportException::UNKNOWN,
+				string("epoll_ctl failed: ") + strerror(errno));
+		}
+	}
+
+	void setWriting(int fd, bool writing) {
+		epoll_event event = makeEvent(fd, writing);
+		epoll_ctl(epollFD, EPOLL_CTL_MOD, fd, &event);
+	}
+
+	void remove(int fd) {
+		std::unique_lock<std::mutex> lock(mutex);
+		epoll_ctl(epollFD, EPOLL_CTL_DEL, fd, nullptr);
+		clients.erase(fd);
+	}
+
+private:
+	// Deadlines are checked at least this often.
+	static const int CHECK_INTERVAL_MS = 500;
+	static const int MAX_EVENTS = 64;
+
+	PipelineLoop() {
+		epollFD = epoll_create1(EPOLL_CLOEXEC);
+		if(epollFD < 0) {
+			throw Error(string("PipelineLoop: epoll_create1 failed: ") + strerror(errno));
+		}
+		thread = std::thread(&PipelineLoop::loop, this);
+	}
+
+	static epoll_event makeEvent(int fd, bool writing) {
+		epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN | EPOLLRDHUP | (writing ? (uint32_t)EPOLLOUT : 0);
+		event.data.fd = fd;
+		return event;
+	}
+
+	shared_ptr<PipelinedJudgeClient> find(int fd) {
+		std::unique_lock<std::mutex> lock(mutex);
+		auto it = clients.find(fd);
+		if(it == clients.end()) return shared_ptr<PipelinedJudgeClient>();
+		return it->second.lock();
+	}
+
+	void loop() {
+		epoll_event events[MAX_EVENTS];
+		while(true) {
+			int count = epoll_wait(epollFD, events, MAX_EVENTS, CHECK_INTERVAL_MS);
+			if(count < 0 && errno != EINTR) {
+				cerr << "PipelineLoop: epoll_wait failed: " << strerror(errno) << "\n";
+				return;
+			}
+			for(int i = 0; i < count; ++i) {
+				shared_ptr<PipelinedJudgeClient> client = find(events[i].data.fd);
+				if(client) client->handleEvents(events[i].events);
+			}
+			vector<shared_ptr<PipelinedJudgeClient>> all;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				for(const auto& i : clients) {
+					shared_ptr<PipelinedJudgeClient> client = i.second.lock();
+					if(client) all.push_back(client);
+				}
+			}
+			auto now = std::chrono::steady_clock::now();
+			for(const shared_ptr<PipelinedJudgeClient>& client : all) {
+				client->checkDeadlines(now);
+			}
+		}
+	}
+
+	int epollFD;
+	std::mutex mutex;
+	map<int, weak_ptr<PipelinedJudgeClient>> clients;
+	std::thread thread;
+};
+
+shared_ptr<PipelinedJudgeClient> PipelinedJudgeClient::create(const string& host, int port) {
+	shared_ptr<PipelinedJudgeClient> client(new PipelinedJudgeClient(host, port));
+	std::unique_lock<std::mutex> lock(client->mutex);
+	client->open();
+	return client;
+}
+
+PipelinedJudgeClient::PipelinedJudgeClient(const string& host, int port)
+	: host(host), port(port) { }
+
+PipelinedJudgeClient::~PipelinedJudgeClient() {
+	if(fd >= 0) PipelineLoop::instance().remove(fd);
+}
+
+std::future<int32_t> PipelinedJudgeClient::getSlotCount(const string& token) {
+	return call<int32_t>(
+		[&](protocol::JudgeClient& client) { client.send_getSlotCount(token); },
+		[](protocol::JudgeClient& client) { return client.recv_getSlotCount(); }
+	);
+}
+
+std::future<protocol::JudgeStatus> PipelinedJudgeClient::status(
+	const string& token,
+	int64_t deadlineMs
+) {
+	return call<protocol::JudgeStatus>(
+		[&](protocol::JudgeClient& client) { client.send_status(token); },
+		[](protocol::JudgeClient& client) -> protocol::JudgeStatus {
+			protocol::JudgeStatus status;
+			client.recv_status(status);
+			return status;
+		},
+		deadlineMs
+	);
+}
+
+std::future<vector<string>> PipelinedJudgeClient::missingFiles(
+	const string& token,
+	const vector<string>& hashes
+) {
+	return call<vector<string>>(
+		[&](protocol::JudgeClient& client) { client.send_missingFiles(token, hashes); },
+		[](protocol::JudgeClient& client) -> vector<string> {
+			vector<string> missing;
+			client.recv_missingFiles(missing);
+			return missing;
+		}
+	);
+}
+
+std::future<int64_t> PipelinedJudgeClient::beginUpload(const string& token, const string& hash) {
+	return call<int64_t>(
+		[&](protocol::JudgeClient& client) { client.send_beginUpload(token, hash); },
+		[](protocol::JudgeClient& client) { return client.recv_beginUpload(); }
+	);
+}
+
+std::future<void> PipelinedJudgeClient::appendUpload(
+	const string& token,
+	const string& hash,
+	int64_t offset,
+	const string& data
+) {
+	return call<void>(
+		[&](protocol::JudgeClient& client) { client.send_appendUpload(token, hash, offset, data); },
+		[](protocol::JudgeClient& client) { client.recv_appendUpload(); }
+	);
+}
+
+std::future<void> PipelinedJudgeClient::commitUpload(
+	const string& token,
+	const string& hash,
+	bool compressed
+) {
+	return call<void>(
+		[&](protocol::JudgeClient& client) { client.send_commitUpload(token, hash, compressed); },
+		[](protocol::JudgeClient& client) { client.recv_commitUpload(); }
+	);
+}
+
+std::future<protocol::StoredFileInfo> PipelinedJudgeClient::getStoredFileInfo(
+	const string& token,
+	const string& hash
+) {
+	return call<protocol::StoredFileInfo>(
+		[&](protocol::JudgeClient& client) { client.send_getStoredFileInfo(token, hash); },
+		[](protocol::JudgeClient& client) -> protocol::StoredFileInfo {
+			protocol::StoredFileInfo info;
+			client.recv_getStoredFileInfo(info);
+			return info;
+		}
+	);
+}
+
+std::future<string> PipelinedJudgeClient::getStoredFileChunk(
+	const string& token,
+	const string& hash,
+	bool compressed,
+	int64_t offset,
+	int32_t length
+) {
+	return call<string>(
+		[&](protocol::JudgeClient& client) {
+			client.send_getStoredFileChunk(token, hash, compressed, offset, length);
+		},
+		[](protocol::JudgeClient& client) -> string {
+			string chunk;
+			client.recv_getStoredFileChunk(chunk);
+			return chunk;
+		}
+	);
+}
+
+void PipelinedJudgeClient::run(
+	const string& token,
+	const protocol::Sandbox& sandbox,
+	const vector<protocol::FileRef>& inputs,
+	const protocol::RunOptions& options,
+	Done<protocol::RunResult> done,
+	int64_t deadlineMs
+) {
+	call<protocol::RunResult>(
+		[&](protocol::JudgeClient& client) { client.send_run(token, sandbox, inputs, options); },
+		[](protocol::JudgeClient& client) -> protocol::RunResult {
+			protocol::RunResult result;
+			client.recv_run(result);
+			return result;
+		},
+		done,
+		deadlineMs
+	);
+}
+
+void PipelinedJudgeClient::runWithFiles(
+	const string& token,
+	const protocol::Sandbox& sandbox,
+	const vector<protocol::FileRef>& inputs,
+	const protocol::RunOptions& options,
+	const vector<string>& files,
+	Done<protocol::RunResult> done,
+	int64_t deadlineMs
+) {
+	call<protocol::RunResult>(
+		[&](protocol::JudgeClient& client) {
+			client.send_runWithFiles(token, sandbox, inputs, options, files);
+		},
+		[](protocol::JudgeClient& client) -> protocol::RunResult {
+			protocol::RunResult result;
+			client.recv_runWithFiles(result);
+			return result;
+		},
+		done,
+		deadlineMs
+	);
+}
+
+void PipelinedJudgeClient::runBatch(
+	const string& token,
+	const protocol::Sandbox& runner,
+	const string& binaryHash,
+	const vector<protocol::BatchTest>& tests,
+	const protocol::RunOptions& options,
+	const protocol::Sandbox& evaluator,
+	const string& evaluatorHash,
+	const protocol::RunOptions& evaluatorOptions,
+	bool stopOnFailure,
+	const vector<string>& files,
+	const protocol::Checker& checker,
+	Done<vector<protocol::BatchResult>> done,
+	int64_t deadlineMs
+) {
+	call<vector<protocol::BatchResult>>(
+		[&](protocol::JudgeClient& client) {
+			client.send_runBatch(token, runner, binaryHash, tests, options,
+				evaluator, evaluatorHash, evaluatorOptions, stopOnFailure, files, checker);
+		},
+		[](protocol::JudgeClient& client) -> vector<protocol::BatchResult> {
+			vector<protocol::BatchResult> results;
+			client.recv_runBatch(results);
+			return results;
+		},
+		done,
+		deadlineMs
+	);
+}
+
+string PipelinedJudgeClient::frame(const Send& send) {
+	using apache::thrift::transport::TMemoryBuffer;
+	using apache::thrift::protocol::TBinaryProtocol;
+
+	boost::shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+	boost::shared_ptr<TBinaryProtocol> output(new TBinaryProtocol(buffer));
+	protocol::JudgeClient client(output);
+	send(client);
+	string payload = buffer->getBufferAsString();
+	uint32_t size = htonl(payload.size());
+	return string((const char*)&size, sizeof(size)) + payload;
+}
+
+unique_ptr<protocol::JudgeClient> PipelinedJudgeClient::clientReading(const string& answer) {
+	using apache::thrift::transport::TMemoryBuffer;
+	using apache::thrift::protocol::TBinaryProtocol;
+
+	boost::shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer(
+		(uint8_t*)answer.data(), answer.size(), TMemoryBuffer::COPY));
+	boost::shared_ptr<TBinaryProtocol> input(new TBinaryProtocol(buffer));
+	return unique_ptr<protocol::JudgeClient>(new protocol::JudgeClient(input));
+}
+
+void PipelinedJudgeClient::enqueue(string frame, Call call, int64_t deadlineMs) {
+	std::deque<Call> failed;
+	string reason;
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		call.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(deadlineMs);
+		calls.push_back(move(call));
+		try {
+			if(fd < 0) open();
+			writeBuffer += frame;
+			if(!flushWrites()) {
+				reason = string("writing to judge failed: ") + strerror(errno);
+				failed = close();
+			}
+		} catch(const TTransportException& e) {
+			reason = e.what();
+			failed = close();
+		}
+	}
+	failCalls(failed, reason);
+}
+
+void PipelinedJudgeClient::handleEvents(uint32_t events) {
+	vector<pair<Call, string>> answered;
+	std::deque<Call> failed;
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if(fd < 0) return;
+		bool ok = readAnswers(answered);
+		if(ok && (events & EPOLLOUT)) ok = flushWrites();
+		if(ok && (events & EPOLLERR)) ok = false;
+		if(!ok) failed = close();
+	}
+	for(pair<Call, string>& i : answered) {
+		i.first.receive(i.second);
+	}
+	failCalls(failed, "connection to judge " + host + " failed");
+}
+
+void PipelinedJudgeClient::checkDeadlines(std::chrono::steady_clock::time_point now) {
+	std::deque<Call> failed;
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		for(const Call& call : calls) {
+			if(call.deadline < now) {
+				failed = close();
+				break;
+			}
+		}
+	}
+	failCalls(failed, "call to judge " + host + " timed out");
+}
+
+void PipelinedJudgeClient::open() {
+	socket.reset(new apache::thrift::transport::TSocket(host, port));
+	socket->setConnTimeout(CONNECT_TIMEOUT_MS);
+	socket->open();
+	fd = socket->getSocketFD();
+	int flags = fcntl(fd, F_GETFL);
+	if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+		throw TTransportException(TTransportException::UNKNOWN,
+			string("fcntl failed: ") + strerror(errno));
+	}
+	writing = false;
+	PipelineLoop::instance().add(shared_from_this(), fd, writing);
+}
+
+bool PipelinedJudgeClient::flushWrites() {
+	size_t written = 0;
+	while(written < writeBuffer.size()) {
+		ssize_t count = send(fd, writeBuffer.data() + written, writeBuffer.size() - written, MSG_NOSIGNAL);
+		if(count < 0) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return false;
+		}
+		written += count;
+	}
+	writeBuffer.erase(0, written);
+	// Wait for the socket to become writable only while data is left.
+	bool wantWriting = !writeBuffer.empty();
+	if(wantWriting != writing) {
+		writing = wantWriting;
+		PipelineLoop::instance().setWriting(fd, writing);
+	}
+	return true;
+}
+
+bool PipelinedJudgeClient::readAnswers(vector<pair<Call, string>>& answered) {
+	char buffer[1 << 16];
+	while(true) {
+		ssize_t count = recv(fd, buffer, sizeof(buffer), 0);
+		if(count == 0) return false;
+		if(count < 0) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return false;
+		}
+		readBuffer.append(buffer, count);
+	}
+	size_t position = 0;
+	while(readBuffer.size() - position >= sizeof(uint32_t)) {
+		uint32_t size;
+		memcpy(&size, readBuffer.data() + position, sizeof(size));
+		size = ntohl(size);
+		if(size > MAX_FRAME_SIZE) return false;
+		if(readBuffer.size() - position - sizeof(size) < size) break;
+		// An answer without a call means the connection is out of sync.
+		if(calls.empty()) return false;
+		answered.push_back(make_pair(move(calls.front()), readBuffer.substr(position + sizeof(size), size)));
+		calls.pop_front();
+		position += sizeof(size) + size;
+	}
+	readBuffer.erase(0, position);
+	return true;
+}
+
+std::deque<PipelinedJudgeClient::Call> PipelinedJudgeClient::close() {
+	if(fd >= 0) {
+		PipelineLoop::instance().remove(fd);
+		fd = -1;
+	}
+	if(socket) socket->close();
+	writeBuffer.clear();
+	readBuffer.clear();
+	std::deque<Call> failed;
+	failed.swap(calls);
+	return failed;
+}
+
+void PipelinedJudgeClient::failCalls(std::deque<Call>& calls, const string& reason) {
+	if(calls.empty()) return;
+	std::exception_ptr error = std::make_exception_ptr(
+		TTransportException(TTransportException::UNKNOWN, reason));
+	for(Call& call : calls) {
+		call.fail(error);
+	}
+}
+
+}
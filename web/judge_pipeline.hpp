@@ -0,0 +1,210 @@
+#pragma once
+#include "common.hpp"
+#include "gen-cpp/Judge.h"
+#include <functional>
+#include <future>
+#include <mutex>
+#include <deque>
+#include <chrono>
+#include <exception>
+#include <thrift/transport/TSocket.h>
+
+namespace cses {
+
+// Connection to a judge host that sends calls without waiting for the
+// answers to earlier ones. The judge answers the calls of a connection in
+// order, so answers are matched to calls by their order. Answers are read by
+// one I/O thread shared by all connections, which hands them to the callers
+// by callbacks or futures.
+//
+// A failed connection fails all calls in flight, and the next call opens it
+// again.
+class PipelinedJudgeClient: public std::enable_shared_from_this<PipelinedJudgeClient> {
+public:
+	typedef std::function<void(protocol::JudgeClient&)> Send;
+	// Answer of a call, which returns the result or throws the error of the
+	// call.
+	template<class T>
+	using Answer = std::function<T()>;
+	// Called with the answer of a call by the I/O thread, or by the caller if
+	// sending fails. Must not block, as it delays the answers of all
+	// connections.
+	template<class T>
+	using Done = std::function<void(Answer<T>)>;
+
+	// Throws TTransportException if connecting fails.
+	static shared_ptr<PipelinedJudgeClient> create(const string& host, int port);
+	~PipelinedJudgeClient();
+
+	// Send the call written by send, which calls a send_ method of the client
+	// before call returns. The answer is read by recv, which calls the matching
+	// recv_ method when the answer given to done is evaluated. If the call is
+	// not answered within deadlineMs, the connection is failed.
+	template<class T>
+	void call(
+		Send send,
+		std::function<T(protocol::JudgeClient&)> recv,
+		Done<T> done,
+		int64_t deadlineMs = DEFAULT_DEADLINE_MS
+	) {
+		Call call;
+		call.receive = [=](const string& answer) {
+			done([=]() -> T {
+				unique_ptr<protocol::JudgeClient> client = clientReading(answer);
+				return recv(*client);
+			});
+		};
+		call.fail = [=](std::exception_ptr error) {
+			done(failed<T>(error));
+		};
+		enqueue(frame(send), move(call), deadlineMs);
+	}
+
+	// Same as above, but the answer is given by the returned future.
+	template<class T>
+	std::future<T> call(
+		Send send,
+		std::function<T(protocol::JudgeClient&)> recv,
+		int64_t deadlineMs = DEFAULT_DEADLINE_MS
+	) {
+		shared_ptr<std::promise<T>> promise = std::make_shared<std::promise<T>>();
+		call<T>(send, recv, [=](Answer<T> answer) { fulfil(*promise, answer); }, deadlineMs);
+		return promise->get_future();
+	}
+
+	// Answer that throws the error.
+	template<class T>
+	static Answer<T> failed(std::exception_ptr error) {
+		return [=]() -> T { std::rethrow_exception(error); };
+	}
+
+	std::future<int32_t> getSlotCount(const string& token);
+	std::future<protocol::JudgeStatus> status(
+		const string& token,
+		int64_t deadlineMs = DEFAULT_DEADLINE_MS
+	);
+	std::future<vector<string>> missingFiles(const string& token, const vector<string>& hashes);
+	std::future<int64_t> beginUpload(const string& token, const string& hash);
+	std::future<void> appendUpload(
+		const string& token,
+		const string& hash,
+		int64_t offset,
+		const string& data
+	);
+	std::future<void> commitUpload(const string& token, const string& hash, bool compressed);
+	std::future<protocol::StoredFileInfo> getStoredFileInfo(const string& token, const string& hash);
+	std::future<string> getStoredFileChunk(
+		const string& token,
+		const string& hash,
+		bool compressed,
+		int64_t offset,
+		int32_t length
+	);
+
+	// Runs are answered by callbacks, so that no thread waits for them.
+	void run(
+		const string& token,
+		const protocol::Sandbox& sandbox,
+		const vector<protocol::FileRef>& inputs,
+		const protocol::RunOptions& options,
+		Done<protocol::RunResult> done,
+		int64_t deadlineMs
+	);
+	void runWithFiles(
+		const string& token,
+		const protocol::Sandbox& sandbox,
+		const vector<protocol::FileRef>& inputs,
+		const protocol::RunOptions& options,
+		const vector<string>& files,
+		Done<protocol::RunResult> done,
+		int64_t deadlineMs
+	);
+	void runBatch(
+		const string& token,
+		const protocol::Sandbox& runner,
+		const string& binaryHash,
+		const vector<protocol::BatchTest>& tests,
+		const protocol::RunOptions& options,
+		const protocol::Sandbox& evaluator,
+		const string& evaluatorHash,
+		const protocol::RunOptions& evaluatorOptions,
+		bool stopOnFailure,
+		const vector<string>& files,
+		const protocol::Checker& checker,
+		Done<vector<protocol::BatchResult>> done,
+		int64_t deadlineMs
+	);
+
+	static const int DEFAULT_DEADLINE_MS = 60000;
+
+private:
+	friend class PipelineLoop;
+
+	struct Call {
+		std::function<void(const string&)> receive;
+		std::function<void(std::exception_ptr)> fail;
+		std::chrono::steady_clock::time_point deadline;
+	};
+
+	static const int CONNECT_TIMEOUT_MS = 5000;
+	// Larger answers are taken as a broken connection.
+	static const size_t MAX_FRAME_SIZE = 256 << 20;
+
+	PipelinedJudgeClient(const string& host, int port);
+
+	// Serialize the call written by send as a frame.
+	static string frame(const Send& send);
+	// Client that reads the answer from the frame payload.
+	static unique_ptr<protocol::JudgeClient> clientReading(const string& answer);
+
+	template<class T>
+	static void fulfil(std::promise<T>& promise, const Answer<T>& answer) {
+		try {
+			promise.set_value(answer());
+		} catch(...) {
+			promise.set_exception(std::current_exception());
+		}
+	}
+	static void fulfil(std::promise<void>& promise, const Answer<void>& answer) {
+		try {
+			answer();
+			promise.set_value();
+		} catch(...) {
+			promise.set_exception(std::current_exception());
+		}
+	}
+
+	void enqueue(string frame, Call call, int64_t deadlineMs);
+
+	// Called by the I/O thread.
+	void handleEvents(uint32_t events);
+	void checkDeadlines(std::chrono::steady_clock::time_point now);
+
+	// The following must be called with the mutex held.
+	void open();
+	// Write as much of the buffered frames as the socket takes. Returns false
+	// if the connection failed.
+	bool flushWrites();
+	// Read the available data and move the answered calls to answered.
+	// Returns false if the connection failed.
+	bool readAnswers(vector<pair<Call, string>>& answered);
+	// Close the connection and return the calls in flight.
+	std::deque<Call> close();
+
+	static void failCalls(std::deque<Call>& calls, const string& reason);
+
+	string host;
+	int port;
+
+	std::mutex mutex;
+	boost::shared_ptr<apache::thrift::transport::TSocket> socket;
+	// Descriptor of the open socket, or -1.
+	int fd = -1;
+	bool writing = false;
+	string writeBuffer;
+	string readBuffer;
+	// Calls waiting for answers in the order they were sent.
+	std::deque<Call> calls;
+};
+
+}
@@ -2,17 +2,24 @@
 #include "judging.hpp"
 #include "common/file.hpp"
 #include "common/io_util.hpp"
+#include "common/judge_interface.hpp"
+#include "common/verdict.hpp"
 #include "model.hpp"
+#include "executor.hpp"
+#include "judge_pipeline.hpp"
 #include <thread>
 #include <condition_variable>
 #include <mutex>
 #include <deque>
+#include <array>
 #include <algorithm>
 #include <unordered_map>
+#include <chrono>
+#include <limits>
+#include <atomic>
+#include <future>
 
-#include <thrift/protocol/TBinaryProtocol.h>
 #include <thrift/transport/TSocket.h>
-#include <thrift/transport/TTransportUtils.h>
 
 namespace {
 using namespace cses;
@@ -27,56 +34,440 @@ StringMap asMap(const protocol::RunResult& result) {
 	return map;
 }
 
+// Hashes and sizes of files that are known to exist on a judge host, shared
+// by all connections to the host.
+class KnownFiles {
+public:
+	bool contains(const string& hash) {
+		std::lock_guard<std::mutex> lock(mutex);
+		return sizes.count(hash);
+	}
+	template<class Iterator>
+	void insert(Iterator begin, Iterator end) {
+		for(Iterator it = begin; it != end; ++it) insert(*it);
+	}
+	// Files are inserted again after every run, so the size is looked up
+	// only for files that are not yet known.
+	void insert(const string& hash) {
+		if (contains(hash)) return;
+		// Size is only used for scheduling, so files that are not stored
+		// here count as empty.
+		int64_t size = fileHashExists(hash) ? fileSizeByHash(hash) : 0;
+		insert(hash, size);
+	}
+	void insert(const string& hash, int64_t size) {
+		std::lock_guard<std::mutex> lock(mutex);
+		sizes[hash] = size;
+	}
+	void clear() {
+		std::lock_guard<std::mutex> lock(mutex);
+		sizes.clear();
+	}
+	// Total size of those of the files that are known to exist.
+	int64_t overlapBytes(const vector<string>& hashes) {
+		std::lock_guard<std::mutex> lock(mutex);
+		int64_t bytes = 0;
+		for(const string& hash: hashes) {
+			auto it = sizes.find(hash);
+			if (it != sizes.end()) bytes += it->second;
+		}
+		return bytes;
+	}
+
+private:
+	std::mutex mutex;
+	std::unordered_map<string, int64_t> sizes;
+};
+
+// Limits the rate of background uploads. Callers that take more than is
+// available sleep until the debt is paid, so concurrent callers share the
+// rate.
+class TokenBucket {
+public:
+	TokenBucket(double ratePerSecond, double capacity):
+		rate(ratePerSecond), capacity(capacity), tokens(capacity),
+		updated(std::chrono::steady_clock::now()) {}
+
+	void take(double amount) {
+		std::unique_lock<std::mutex> lock(mutex);
+		auto now = std::chrono::steady_clock::now();
+		tokens = std::min(capacity,
+			tokens + rate * std::chrono::duration<double>(now - updated).count());
+		updated = now;
+		tokens -= amount;
+		if (tokens >= 0) return;
+		std::chrono::duration<double> wait(-tokens / rate);
+		lock.unlock();
+		std::this_thread::sleep_for(wait);
+	}
+
+private:
+	std::mutex mutex;
+	double rate;
+	double capacity;
+	double tokens;
+	std::chrono::steady_clock::time_point updated;
+};
+
+// Connection to one execution slot of a judge host. All calls of the slot
+// are pipelined on its own connection, as the judge serves the calls of a
+// connection one at a time. Runs are asynchronous: their results are given
+// to a callback on a worker, so that no thread waits while the judge runs
+// programs. Other calls are short and wait for their answers.
 struct JudgeConnection {
+	template<class T>
+	using Answer = PipelinedJudgeClient::Answer<T>;
+	// Called on a worker with the result of a run, after its outputs have
+	// been fetched.
+	template<class T>
+	using Done = PipelinedJudgeClient::Done<T>;
+
 	JudgeHost host;
-	const shared_ptr<protocol::JudgeClient> client;
+	int slot;
+	const shared_ptr<KnownFiles> knownFiles;
+	// Pipelined connection shared by the slots of the host for polling
+	// status.
+	const shared_ptr<PipelinedJudgeClient> statusPipeline;
+	const shared_ptr<PipelinedJudgeClient> pipeline;
+	Executor* workers;
 	string token = "uolevi";
 
-	JudgeConnection(JudgeHost host): host(host), client(new protocol::JudgeClient(makeProtocol(host.host, host.port))) {
+	JudgeConnection(
+		JudgeHost host,
+		int slot,
+		shared_ptr<KnownFiles> knownFiles,
+		shared_ptr<PipelinedJudgeClient> statusPipeline,
+		Executor* workers
+	):
+		host(host),
+		slot(slot),
+		knownFiles(knownFiles),
+		statusPipeline(statusPipeline),
+		pipeline(PipelinedJudgeClient::create(host.host, host.port)),
+		workers(workers)
+	{
 	}
 
-	protocol::RunResult runOnJudge(Sandbox sandbox, const StringMap& inputs, double timeLimit, int memoryLimit) {
+	void runOnJudge(
+		Sandbox sandbox,
+		const StringMap& inputs,
+		double timeLimit,
+		int memoryLimit,
+		Done<protocol::RunResult> done
+	) {
 		cerr<<"running on judge "<<host.name<<' '<<inputs.size()<<'\n';
 		vector<protocol::FileRef> fileRefs;
+		shared_ptr<RunCall<protocol::RunResult>> run(new RunCall<protocol::RunResult>());
 		for(const auto& i: inputs) {
 			cerr<<"input "<<i.first<<' '<<i.second<<'\n';
-			if (!client->hasFile(token, i.second)) {
-				cerr<<"sending input\n";
-				client->sendFile(token, readFileByHash(i.second));
-			}
 			protocol::FileRef ref;
 			ref.hash = i.second;
 			ref.name = i.first;
 			fileRefs.push_back(move(ref));
+			run->neededFiles.push_back(i.second);
+		}
+		cses::protocol::Sandbox protoSandbox = makeSandbox(sandbox);
+		if (protoSandbox.__isset.ptrace) {
+			run->neededFiles.push_back(protoSandbox.ptrace.runnerHash);
 		}
 		protocol::RunOptions options;
 		options.timeLimit = timeLimit;
 		options.memoryLimitBytes = memoryLimit;
-		protocol::RunResult result;
-		cerr<<"calling run\n";
-		client->run(result, token, makeSandbox(sandbox), fileRefs, options);
-		cerr<<"return from run\n";
-		for(protocol::FileRef outFile: result.outputs) {
-			if (!fileHashExists(outFile.hash)) {
-				string data;
-				client->getFile(data, token, outFile.hash);
-				FileSave save;
-				save.write(&data[0], data.size());
-				save.save();
+		int64_t deadline = runDeadline(timeLimit);
+		run->send = [=](const vector<string>& inlineFiles, Done<protocol::RunResult> answered) {
+			cerr<<"calling run with "<<inlineFiles.size()<<" inline files\n";
+			if (inlineFiles.empty()) {
+				pipeline->run(token, protoSandbox, fileRefs, options, answered, deadline);
+			} else {
+				pipeline->runWithFiles(token, protoSandbox, fileRefs, options, inlineFiles, answered, deadline);
 			}
-			cerr<<' '<<outFile.name;
+		};
+		run->fetchOutputs = [=](const protocol::RunResult& result) {
+			cerr<<"return from run\n";
+			fetchOutputs(result);
+		};
+		sendRun(run, done);
+	}
+
+	// Run and evaluate a group of tests with a single call. The result has
+	// one entry per test, or less if stopOnFailure is set and some test
+	// failed.
+	void runBatchOnJudge(
+		Sandbox runner,
+		const string& binaryHash,
+		const vector<protocol::BatchTest>& tests,
+		double timeLimit,
+		int64_t memoryLimit,
+		Sandbox evaluator,
+		const string& evaluatorHash,
+		double evaluatorTimeLimit,
+		int64_t evaluatorMemoryLimit,
+		bool stopOnFailure,
+		const protocol::Checker& checker,
+		Done<vector<protocol::BatchResult>> done
+	) {
+		cerr<<"running batch on judge "<<host.name<<' '<<tests.size()<<'\n';
+		bool customChecker = checker.type == protocol::CheckerType::CUSTOM;
+		shared_ptr<RunCall<vector<protocol::BatchResult>>> run(new RunCall<vector<protocol::BatchResult>>());
+		vector<string>& neededFiles = run->neededFiles;
+		neededFiles.push_back(binaryHash);
+		for(const protocol::BatchTest& test: tests) {
+			neededFiles.push_back(test.inputHash);
+			neededFiles.push_back(test.correctHash);
 		}
-		cerr<<'\n';
-		return result;
+		cses::protocol::Sandbox protoRunner = makeSandbox(runner);
+		cses::protocol::Sandbox protoEvaluator = makeSandbox(evaluator);
+		vector<const protocol::Sandbox*> sandboxes{&protoRunner};
+		if (customChecker) {
+			neededFiles.push_back(evaluatorHash);
+			sandboxes.push_back(&protoEvaluator);
+		}
+		for(const protocol::Sandbox* sandbox: sandboxes) {
+			if (sandbox->__isset.ptrace) {
+				neededFiles.push_back(sandbox->ptrace.runnerHash);
+			}
+		}
+		protocol::RunOptions options;
+		options.timeLimit = timeLimit;
+		options.memoryLimitBytes = memoryLimit;
+		protocol::RunOptions evaluatorOptions;
+		evaluatorOptions.timeLimit = evaluatorTimeLimit;
+		evaluatorOptions.memoryLimitBytes = evaluatorMemoryLimit;
+		int64_t deadline = tests.size() * (runDeadline(timeLimit) + runDeadline(evaluatorTimeLimit));
+		run->send = [=](const vector<string>& inlineFiles, Done<vector<protocol::BatchResult>> answered) {
+			pipeline->runBatch(token, protoRunner, binaryHash, tests, options,
+				protoEvaluator, evaluatorHash, evaluatorOptions, stopOnFailure, inlineFiles,
+				checker, answered, deadline);
+		};
+		run->fetchOutputs = [=](const vector<protocol::BatchResult>& results) {
+			cerr<<"return from batch with "<<results.size()<<" results\n";
+			for(const protocol::BatchResult& result: results) {
+				fetchOutputs(result.run);
+				if (result.__isset.evaluation) fetchOutputs(result.evaluation);
+			}
+		};
+		sendRun(run, done);
+	}
+
+	// Upload those of the files that the judge doesn't have, at the rate
+	// allowed by the throttle. Stops once about maxBytes have been sent and
+	// returns the files that were not handled.
+	vector<string> prefetchFiles(const vector<string>& hashes, TokenBucket& throttle, int64_t maxBytes) {
+		vector<string> unknown;
+		for(const string& hash: hashes) {
+			if (!knownFiles->contains(hash)) unknown.push_back(hash);
+		}
+		if (unknown.empty()) return unknown;
+		vector<string> missing = pipeline->missingFiles(token, unknown).get();
+		std::set<string> missingSet(missing.begin(), missing.end());
+		int64_t sent = 0;
+		for(size_t i = 0; i < unknown.size(); ++i) {
+			const string& hash = unknown[i];
+			if (missingSet.count(hash)) {
+				if (sent >= maxBytes) {
+					return vector<string>(unknown.begin() + i, unknown.end());
+				}
+				sendFile(hash, &throttle);
+				sent += storedFileInfo(hash).size;
+			}
+			knownFiles->insert(hash);
+		}
+		cerr<<"prefetched "<<sent<<" bytes to judge "<<host.name<<'\n';
+		return vector<string>();
 	}
 
 	bool operator<(const JudgeConnection& c) const {
 		if (host.name != c.host.name) return host.name < c.host.name;
 		if (host.host != c.host.host) return host.host < c.host.host;
-		return host.port < c.host.port;
+		if (host.port != c.host.port) return host.port < c.host.port;
+		return slot < c.slot;
 	}
 
 private:
+	static const size_t FILE_CHUNK_SIZE = 1 << 20;
+	// Number of upload chunks sent before waiting for the first of them.
+	static const size_t UPLOAD_WINDOW = 8;
+	static const int MAX_TRANSFER_ATTEMPTS = 3;
+	static const size_t MAX_INLINE_FILE_SIZE = 1 << 20;
+	// Deadline of a run is its time limit multiplied by the factor plus the
+	// sandbox setup time.
+	static const int RUN_DEADLINE_FACTOR = 3;
+	static const int RUN_SETUP_MS = 30000;
+
+	// Run that is sent again if the judge has removed files it needs.
+	template<class T>
+	struct RunCall {
+		vector<string> neededFiles;
+		// Send the run with the contents of the given missing files.
+		std::function<void(const vector<string>&, Done<T>)> send;
+		std::function<void(const T&)> fetchOutputs;
+	};
+
+	static int64_t runDeadline(double timeLimit) {
+		return RUN_SETUP_MS + (int64_t)(timeLimit * 1000 * RUN_DEADLINE_FACTOR);
+	}
+
+	// Send the files needed by the run and the run. The answer is handled
+	// on a worker, which fetches the outputs and calls done. If the judge
+	// is missing files, they are sent again and so is the run.
+	template<class T>
+	void sendRun(shared_ptr<RunCall<T>> run, Done<T> done, int attempt = 1) {
+		vector<string> inlineFiles;
+		try {
+			inlineFiles = sendMissingFiles(run->neededFiles);
+		} catch(...) {
+			done(PipelinedJudgeClient::failed<T>(std::current_exception()));
+			return;
+		}
+		Executor* workers = this->workers;
+		run->send(inlineFiles, [=](Answer<T> answer) {
+			try {
+				workers->submit([=]() { finishRun(run, done, attempt, answer); });
+			} catch(const Error& e) {
+				// The server is shutting down.
+				cerr<<"Dropping answer of run: "<<e.what()<<'\n';
+			}
+		});
+	}
+
+	template<class T>
+	void finishRun(shared_ptr<RunCall<T>> run, Done<T> done, int attempt, Answer<T> answer) {
+		Answer<T> outcome;
+		bool resend = false;
+		try {
+			T result = answer();
+			knownFiles->insert(run->neededFiles.begin(), run->neededFiles.end());
+			run->fetchOutputs(result);
+			outcome = [=]() { return result; };
+		} catch(const protocol::InvalidDataError& e) {
+			resend = attempt < MAX_TRANSFER_ATTEMPTS && filesWereRemoved(e);
+			if (!resend) outcome = PipelinedJudgeClient::failed<T>(std::current_exception());
+		} catch(...) {
+			outcome = PipelinedJudgeClient::failed<T>(std::current_exception());
+		}
+		// Outside the handlers, as done continues the task.
+		if (resend) {
+			sendRun(run, done, attempt + 1);
+		} else {
+			done(outcome);
+		}
+	}
+
+	// Judges remove least recently used files to free space, so files that
+	// are known to exist may be gone. Forgets the known files of the host if
+	// the error was caused by that, so that they are checked again.
+	bool filesWereRemoved(const protocol::InvalidDataError& e) {
+		if (e.msg != judge_interface::MISSING_FILES_MESSAGE) return false;
+		cerr<<"judge "<<host.name<<" has removed files, sending again\n";
+		knownFiles->clear();
+		return true;
+	}
+
+	// Make sure that the judge has all the given files, asking for the missing
+	// ones with a single call. Large missing files are uploaded right away,
+	// and the contents of small ones are returned to be sent with the run.
+	// Does no calls if all files are already known to exist on the judge.
+	vector<string> sendMissingFiles(const vector<string>& hashes) {
+		std::set<string> unknown;
+		for(const string& hash: hashes) {
+			if (!knownFiles->contains(hash)) unknown.insert(hash);
+		}
+		vector<string> inlineFiles;
+		if (unknown.empty()) return inlineFiles;
+
+		vector<string> missing = pipeline->missingFiles(token, vector<string>(unknown.begin(), unknown.end())).get();
+		for(const string& hash: unknown) {
+			if (std::find(missing.begin(), missing.end(), hash) == missing.end()) {
+				knownFiles->insert(hash);
+			}
+		}
+
+		size_t inlineSize = 0;
+		for(const string& hash: missing) {
+			int64_t size = fileSizeByHash(hash);
+			if (size <= (int64_t)MAX_INLINE_FILE_SIZE &&
+				inlineSize + size <= judge_interface::MAX_INLINE_FILES_SIZE)
+			{
+				inlineFiles.push_back(readFileByHash(hash));
+				inlineSize += size;
+			} else {
+				cerr<<"sending input "<<hash<<'\n';
+				sendFile(hash);
+				knownFiles->insert(hash, size);
+			}
+		}
+		return inlineFiles;
+	}
+
+	// Upload stored file to the judge in chunks, pipelining up to
+	// UPLOAD_WINDOW chunks. If the connection drops, continues from the data
+	// the judge already has on a new connection. Chunks are taken from the
+	// throttle if one is given.
+	void sendFile(const string& hash, TokenBucket* throttle = nullptr) {
+		for(int attempt = 1; ; ++attempt) {
+			try {
+				// Compressed files are sent as they are stored.
+				StoredFileInfo info = storedFileInfo(hash);
+				int64_t offset = pipeline->beginUpload(token, hash).get();
+				std::deque<std::future<void>> appends;
+				while(offset < info.size) {
+					string chunk = readStoredFileChunk(hash, info.compressed, offset, FILE_CHUNK_SIZE);
+					if (chunk.empty()) throw Error("Stored file ended unexpectedly.");
+					if (throttle) throttle->take(chunk.size());
+					if (appends.size() == UPLOAD_WINDOW) {
+						appends.front().get();
+						appends.pop_front();
+					}
+					appends.push_back(pipeline->appendUpload(token, hash, offset, chunk));
+					offset += chunk.size();
+				}
+				// The judge answers in order, so all chunks are stored once
+				// the last one is.
+				if (!appends.empty()) appends.back().get();
+				pipeline->commitUpload(token, hash, info.compressed).get();
+				return;
+			} catch(const apache::thrift::transport::TTransportException& e) {
+				if (attempt >= MAX_TRANSFER_ATTEMPTS) throw;
+				cerr<<"upload of "<<hash<<" interrupted, resuming: "<<e.what()<<'\n';
+			}
+		}
+	}
+
+	// Download file from the judge in chunks to the local file store.
+	void fetchFile(const string& hash) {
+		for(int attempt = 1; ; ++attempt) {
+			try {
+				protocol::StoredFileInfo info = pipeline->getStoredFileInfo(token, hash).get();
+				FileSave save(info.compressed);
+				int64_t offset = 0;
+				while(offset < info.size) {
+					string chunk = pipeline->getStoredFileChunk(
+						token, hash, info.compressed, offset, FILE_CHUNK_SIZE).get();
+					if (chunk.empty()) throw Error("File from judge ended unexpectedly.");
+					save.write(chunk.data(), chunk.size());
+					offset += chunk.size();
+				}
+				if (save.save() != hash) throw Error("File from judge does not match its hash.");
+				return;
+			} catch(const apache::thrift::transport::TTransportException& e) {
+				if (attempt >= MAX_TRANSFER_ATTEMPTS) throw;
+				cerr<<"download of "<<hash<<" interrupted, retrying: "<<e.what()<<'\n';
+			}
+		}
+	}
+
+	void fetchOutputs(const protocol::RunResult& result) {
+		for(const protocol::FileRef& outFile: result.outputs) {
+			if (!fileHashExists(outFile.hash)) {
+				fetchFile(outFile.hash);
+			}
+			// Outputs stay on the judge, for example compiled binaries.
+			knownFiles->insert(outFile.hash);
+			cerr<<' '<<outFile.name;
+		}
+		cerr<<'\n';
+	}
+
 	cses::protocol::Sandbox makeSandbox(Sandbox sandbox) {
 		cses::protocol::Sandbox res;
 		cerr<<"sandbox type "<<sandbox.type<<'\n';
@@ -97,32 +488,18 @@ private:
 					p.allowedSyscalls = sandbox.ptrace.allowedSyscalls;
 					p.runnerHash = sandbox.ptrace.runner.hash;
 					res.__set_ptrace(p);
-					if (!client->hasFile(token, p.runnerHash)) {
-						client->sendFile(token, readFileByHash(p.runnerHash));
-					}
 				}
 				break;
 		}
 		return res;
 	}
-
-	static boost::shared_ptr<apache::thrift::protocol::TProtocol> makeProtocol(string host, int port) {
-		using namespace apache::thrift;
-		using namespace apache::thrift::protocol;
-		using namespace apache::thrift::transport;
-
-		boost::shared_ptr<TTransport> socket(new TSocket(host, port));
-		boost::shared_ptr<TTransport> transport(new TBufferedTransport(socket));
-		boost::shared_ptr<TProtocol> protocol(new TBinaryProtocol(transport));
-		transport->open();
-		return protocol;
-	}
 };
 
 class JudgeMaster;
 struct ReturnConnection {
 	JudgeMaster& master;
 	JudgeConnection& connection;
+	bool background;
 	~ReturnConnection();
 };
 
@@ -148,33 +525,241 @@ void printErrorForTypes(const ::apache::thrift::TException& e) {
 	PrintError<X...>::printError(e);
 }
 
+// Priority classes of tasks, most urgent first.
+enum class TaskPriority {
+	LIVE_CONTEST,
+	PRACTICE,
+	REJUDGE,
+};
+const int TASK_PRIORITY_COUNT = 3;
+
 class UnitTask {
 public:
 	virtual ~UnitTask() {}
 
-	void execute(JudgeConnection connection, JudgeMaster& master) {
-		unique_ptr<UnitTask> self(this);
-		ReturnConnection ret{master, connection};
-		(void)ret;
-		this->connection = &connection;
-		this->master = &master;
-		try {
-			run();
-		} catch(const ::apache::thrift::TException& e) {
-			namespace P = protocol;
-			printErrorForTypes<P::InternalError, P::InvalidDataError, P::AuthError, P::DockerError>(e);
-		} catch(const std::exception& e) {
-			cerr<<"Internal judging exception "<<e.what()<<'\n';
-		} catch(...) {
-			cerr<<"Unknown judging exception\n";
-		}
+	// Run the task and delete it, or queue it again on another host if it
+	// failed because of the judge host. A task waiting for a run continues
+	// on another worker after this returns.
+	void execute(JudgeConnection connection, JudgeMaster& master);
+
+	// Whether the error is caused by the judge host or the connection to it
+	// rather than by the task, so that the task can be run again elsewhere.
+	static bool isInfrastructureFailure(const ::apache::thrift::TException& e) {
+		return dynamic_cast<const apache::thrift::transport::TTransportException*>(&e) ||
+			dynamic_cast<const protocol::InternalError*>(&e) ||
+			dynamic_cast<const protocol::DockerError*>(&e);
+	}
+
+	// Whether the task will be run again after failing with the error. Tasks
+	// should then leave the results of their work as if not yet started.
+	bool willRetry(const ::apache::thrift::TException& e) const {
+		return retryable() && attempts + 1 < MAX_ATTEMPTS && isInfrastructureFailure(e);
+	}
+
+	// Store the task in the database queue, so that it is continued if the
+	// server is restarted before it finishes. Tasks without a queue entry
+	// are not stored. Must be called in a transaction.
+	void persistQueueEntry() {
+		optional<PendingJudgeTask> entry = queueEntry();
+		if (!entry) return;
+		entry->priority = (int)priority;
+		entry->user = userID;
+		queueEntryID = db::persist(*entry);
+	}
+
+	// Remove the task from the database queue once its results are stored.
+	// Must be called in a transaction.
+	void eraseQueueEntry() {
+		db::erase<PendingJudgeTask>(queueEntryID);
+		queueEntryID = 0;
 	}
 
-	JudgeConnection* connection;
+	unique_ptr<JudgeConnection> connection;
 	JudgeMaster* master;
+	TaskPriority priority = TaskPriority::PRACTICE;
+	// User whose work the task is, used for fair scheduling.
+	ID userID = 0;
+	// Files the task sends to the judge, used to place it on a judge host
+	// that already has them.
+	vector<string> files;
+	// ID of the task in the database queue, or 0 if not stored.
+	ID queueEntryID = 0;
+	// Set for tasks that run only when their host has nothing else to do.
+	bool background = false;
+	// Number of failed attempts to run the task, and the hosts they were
+	// run on. The task is run at most MAX_ATTEMPTS times.
+	int attempts = 0;
+	std::set<string> failedHosts;
 	virtual void run() = 0;
 
+	static const int MAX_ATTEMPTS = 3;
+
+protected:
+	virtual bool retryable() const { return true; }
+
+	// Describe the task for storing in the database queue, or return nothing
+	// if the task is lost on restart.
+	virtual optional<PendingJudgeTask> queueEntry() = 0;
+
+	// Called when a step of the task fails, before the task is finished or
+	// retried. The error is null if it didn't come from the judge.
+	virtual void onFailure(const ::apache::thrift::TException*) {}
+
+	// End the current step of the task with a run started by start, and
+	// continue the task with then on a worker once the run is answered, so
+	// that no worker waits for it. The run is started after the step
+	// returns, as the task may continue right away.
+	template<class T>
+	void await(
+		std::function<void(JudgeConnection::Done<T>)> start,
+		std::function<void(JudgeConnection::Answer<T>)> then
+	) {
+		nextRun = [this, start, then]() {
+			start([this, then](JudgeConnection::Answer<T> answer) {
+				step([&]() { then(answer); });
+			});
+		};
+	}
+
+private:
+	std::function<void()> nextRun;
+
+	// Run a step of the task, and finish the task unless the step awaits a
+	// run.
+	void step(std::function<void()> body);
+	void handleFailure(const ::apache::thrift::TException* e);
+	void finish(bool retry, bool hostFailed);
+};
+
+// Queue of pending tasks. Tasks are taken in priority order, and tasks of
+// equal priority round robin over users so that a flood of tasks of one
+// user doesn't delay the others. A task can also be queued locally for a
+// judge host that already has its data. The host prefers those over general
+// tasks of the same priority, and other hosts steal them when they have
+// nothing else to do. Background tasks are pinned to one host and run only
+// when the host has nothing else to do.
+class TaskScheduler {
+public:
+	void push(UnitTask* task, const string& hostName = "") {
+		Queues& queues = hostName.empty() ? general : local[hostName];
+		queues[(int)task->priority].push(task);
+		++count;
+	}
+
+	void pushBackground(UnitTask* task, const string& hostName) {
+		task->background = true;
+		background[hostName].push_back(task);
+		++count;
+	}
+
+	// Take next task for a free slot of given host, or nullptr if there are
+	// no tasks. Background tasks are taken only if takeBackground is set.
+	UnitTask* pop(const string& hostName, bool takeBackground) {
+		auto own = local.find(hostName);
+		for(int priority = 0; priority < TASK_PRIORITY_COUNT; ++priority) {
+			if (own != local.end() && !own->second[priority].empty()) {
+				return take(own->second[priority]);
+			}
+			if (!general[priority].empty()) {
+				return take(general[priority]);
+			}
+		}
+		for(int priority = 0; priority < TASK_PRIORITY_COUNT; ++priority) {
+			FairQueue* victim = nullptr;
+			for(auto& i: local) {
+				FairQueue& queue = i.second[priority];
+				if (!queue.empty() && (!victim || queue.size() > victim->size())) {
+					victim = &queue;
+				}
+			}
+			if (victim) return take(*victim);
+		}
+		auto pinned = background.find(hostName);
+		if (takeBackground && pinned != background.end() && !pinned->second.empty()) {
+			UnitTask* task = pinned->second.front();
+			pinned->second.pop_front();
+			--count;
+			return task;
+		}
+		return nullptr;
+	}
+
+	// Delete the background tasks of all hosts, whose connections are gone.
+	void dropBackground() {
+		for(auto& i: background) {
+			for(UnitTask* task: i.second) {
+				delete task;
+			}
+			count -= i.second.size();
+		}
+		background.clear();
+	}
+
+	size_t size() const {
+		return count;
+	}
+	bool empty() const {
+		return count == 0;
+	}
+
+	// Number of tasks queued locally for the host.
+	size_t localSize(const string& hostName) const {
+		auto own = local.find(hostName);
+		if (own == local.end()) return 0;
+		size_t ret = 0;
+		for(const FairQueue& queue: own->second) {
+			ret += queue.size();
+		}
+		return ret;
+	}
+
 private:
+	// Round robin queue over users.
+	class FairQueue {
+	public:
+		void push(UnitTask* task) {
+			std::deque<UnitTask*>& tasks = byUser[task->userID];
+			if (tasks.empty()) users.push_back(task->userID);
+			tasks.push_back(task);
+			++count;
+		}
+		UnitTask* pop() {
+			ID user = users.front();
+			users.pop_front();
+			std::deque<UnitTask*>& tasks = byUser[user];
+			UnitTask* task = tasks.front();
+			tasks.pop_front();
+			if (tasks.empty()) {
+				byUser.erase(user);
+			} else {
+				users.push_back(user);
+			}
+			--count;
+			return task;
+		}
+		size_t size() const {
+			return count;
+		}
+		bool empty() const {
+			return count == 0;
+		}
+
+	private:
+		std::map<ID, std::deque<UnitTask*>> byUser;
+		std::deque<ID> users;
+		size_t count = 0;
+	};
+	typedef std::array<FairQueue, TASK_PRIORITY_COUNT> Queues;
+
+	UnitTask* take(FairQueue& queue) {
+		--count;
+		return queue.pop();
+	}
+
+	Queues general;
+	std::map<string, Queues> local;
+	std::map<string, std::deque<UnitTask*>> background;
+	size_t count = 0;
 };
 
 class JudgeMaster {
@@ -184,18 +769,44 @@ public:
 		return master;
 	}
 
-	void judgeLoop() {
-		while(1) {
+	~JudgeMaster() {
+		{
 			auto lock = getLock();
+			stopping = true;
+			condition.notify_one();
+		}
+		mainThread.join();
+		timers.shutdown();
+		connectors.shutdown();
+		workers.shutdown();
+	}
+
+	void judgeLoop() {
+		auto lock = getLock();
+		while(!stopping) {
 			condition.wait(lock);
 			cerr<<"checking for tasks and judges.\n";
 			startJudgings();
 		}
 	}
 
-	void addTask(UnitTask* task) {
+	// Queue task for judging. If hostName is given, the task is preferably
+	// run on that judge host. Otherwise a task that lists its files is
+	// preferably run on the host that has most bytes of them.
+	void addTask(UnitTask* task, const string& hostName = "") {
+		if (!task->queueEntryID) {
+			if (odb::transaction::has_current()) {
+				task->persistQueueEntry();
+			} else {
+				odb::transaction t(db::begin());
+				task->persistQueueEntry();
+				t.commit();
+			}
+		}
 		auto lock = getLock();
-		pendingTasks.push_back(task);
+		string host = hostName;
+		if (host.empty() && !task->files.empty()) host = bestHostFor(*task);
+		pendingTasks.push(task, host);
 		condition.notify_one();
 	}
 
@@ -208,297 +819,1302 @@ public:
 			hosts.assign(result.begin(), result.end());
 		}
 		allJudgeHosts.clear();
+		hostFiles.clear();
+		hostStatus.clear();
+		// Files prefetched on the old connections are not known to the new
+		// ones, and hosts not connected again would keep their tasks.
+		pendingTasks.dropBackground();
 		for(JudgeHost host: hosts) {
-			std::thread(&JudgeMaster::connectToJudgeHostLoop, this, host).detach();
+			connectors.submit([=]() { connectToJudgeHost(host, std::chrono::milliseconds(MIN_RECONNECT_DELAY_MS)); });
+		}
+		condition.notify_one();
+	}
+
+	// Queue task to run on the given host when it has nothing else to do,
+	// dropping it if the host is not connected. Background tasks are not
+	// stored in the database queue.
+	void addBackgroundTask(UnitTask* task, const string& hostName) {
+		auto lock = getLock();
+		bool connected = std::any_of(allJudgeHosts.begin(), allJudgeHosts.end(),
+			[&](const JudgeConnection& conn) { return conn.host.name == hostName; });
+		if (!connected) {
+			delete task;
+			return;
+		}
+		pendingTasks.pushBackground(task, hostName);
+		condition.notify_one();
+	}
+
+	// Queue a failed task again, preferably on the healthiest host it has not
+	// failed on.
+	void retryTask(UnitTask* task) {
+		auto lock = getLock();
+		pendingTasks.push(task, healthiestHost(task->failedHosts));
+		condition.notify_one();
+	}
+
+	// Queue a copy of a slow task on another healthy host, dropping it if
+	// there is none.
+	void addHedgeTask(UnitTask* task, const string& excludedHost) {
+		auto lock = getLock();
+		string host = healthiestHost({excludedHost});
+		if (host.empty()) {
+			delete task;
+			return;
 		}
+		cerr<<"hedging slow task on host "<<host<<'\n';
+		pendingTasks.push(task, host);
 		condition.notify_one();
 	}
 
+	// Record whether a task run on the host succeeded as far as the host is
+	// concerned.
+	void reportOutcome(const string& hostName, bool ok) {
+		auto lock = getLock();
+		HostHealth& h = health[hostName];
+		h.failureRate = (1 - HEALTH_DECAY) * h.failureRate + HEALTH_DECAY * (ok ? 0 : 1);
+		if (ok) return;
+		h.lastFailure = std::chrono::steady_clock::now();
+		if (!isHealthy(hostName)) {
+			cerr<<"judge host "<<hostName<<" is failing, pausing it\n";
+			// Give the host tasks again after the cooldown.
+			timers.schedule(std::chrono::milliseconds(HEALTH_COOLDOWN_MS), [this]() {
+				auto lock = getLock();
+				condition.notify_one();
+			});
+		}
+	}
+
+	// Connected host that is not excluded and fails least often, or empty if
+	// there is none. Must be called with the lock held.
+	string healthiestHost(const std::set<string>& excluded) {
+		string best;
+		double bestRate = 2;
+		for(const JudgeConnection& conn: allJudgeHosts) {
+			const string& name = conn.host.name;
+			if (excluded.count(name) || !isAvailable(name)) continue;
+			double rate = health.count(name) ? health[name].failureRate : 0;
+			if (rate < bestRate) {
+				best = name;
+				bestRate = rate;
+			}
+		}
+		return best;
+	}
+
+	std::set<string> connectedHostNames() {
+		auto lock = getLock();
+		std::set<string> names;
+		for(const JudgeConnection& conn: allJudgeHosts) {
+			names.insert(conn.host.name);
+		}
+		return names;
+	}
+
+	void schedule(std::chrono::milliseconds delay, Executor::Job job) {
+		timers.schedule(delay, job);
+	}
+
 	void addConnectedJudgeHost(JudgeConnection conn) {
 		auto lock = getLock();
 		allJudgeHosts.insert(JudgeConnection(conn));
 		condition.notify_one();
 	}
 
-	void returnConnection(JudgeConnection conn) {
+	// Free the slot of a finished task.
+	void returnConnection(JudgeConnection conn, bool background) {
 		auto lock = getLock();
 		usedJudgeHosts.erase(conn);
+		if (background) --runningBackgroundTasks;
 		condition.notify_one();
 	}
 
 private:
-	JudgeMaster(): mainThread(&JudgeMaster::judgeLoop, this) {}
+	static const size_t WORKER_THREAD_COUNT = 16;
+	// Background tasks may wait for the prefetch throttle on a worker, so
+	// they get only some of the workers.
+	static const size_t MAX_RUNNING_BACKGROUND_TASKS = WORKER_THREAD_COUNT / 4;
+	static const size_t CONNECTOR_THREAD_COUNT = 2;
+	// Tasks are not queued locally for a host that already has this many
+	// queued tasks per slot, so that a busy host doesn't delay them.
+	static const size_t SPILL_OVER_TASKS_PER_SLOT = 2;
+	// Weight of the latest outcome in the failure rate of a host.
+	static constexpr double HEALTH_DECAY = 0.2;
+	// Hosts failing more often than this get no tasks until the cooldown
+	// since their last failure has passed.
+	static constexpr double MAX_FAILURE_RATE = 0.5;
+	static const int HEALTH_COOLDOWN_MS = 30000;
+	static const int STATUS_POLL_INTERVAL_MS = 10000;
+	// Less than the poll interval, so that a stuck host doesn't delay the
+	// next poll.
+	static const int STATUS_DEADLINE_MS = 5000;
+	static const int MIN_RECONNECT_DELAY_MS = 1000;
+	static const int MAX_RECONNECT_DELAY_MS = 60000;
 
-	std::thread mainThread;
+	JudgeMaster():
+		workers(WORKER_THREAD_COUNT),
+		connectors(CONNECTOR_THREAD_COUNT),
+		timers(connectors, std::chrono::milliseconds(500), 256),
+		mainThread(&JudgeMaster::judgeLoop, this)
+	{
+		timers.schedule(std::chrono::milliseconds(STATUS_POLL_INTERVAL_MS), [this]() { pollStatus(); });
+	}
+
+	// Judging tasks are run by workers, which don't wait for runs, so a few
+	// of them serve all slots. Judge hosts are connected to by connectors.
+	Executor workers;
+	Executor connectors;
+	TimerWheel timers;
+	bool stopping = false;
 
 	std::unique_lock<std::mutex> getLock() {
 		return std::unique_lock<std::mutex>(mutex);
 	}
 
+	// Connected host with most bytes of the task's files, or empty if no
+	// host that is not too busy has any of them. Must be called with the
+	// lock held.
+	string bestHostFor(const UnitTask& task) {
+		std::map<string, size_t> slots;
+		for(const JudgeConnection& conn: allJudgeHosts) {
+			++slots[conn.host.name];
+		}
+		string best;
+		int64_t bestBytes = 0;
+		for(const auto& host: slots) {
+			auto files = hostFiles.find(host.first);
+			if (files == hostFiles.end() || !isAvailable(host.first)) continue;
+			if (pendingTasks.localSize(host.first) >= SPILL_OVER_TASKS_PER_SLOT * host.second) continue;
+			int64_t bytes = files->second->overlapBytes(task.files);
+			if (bytes > bestBytes) {
+				best = host.first;
+				bestBytes = bytes;
+			}
+		}
+		return best;
+	}
+
+	struct HostHealth {
+		double failureRate = 0;
+		std::chrono::steady_clock::time_point lastFailure;
+	};
+
+	bool isHealthy(const string& hostName) {
+		auto it = health.find(hostName);
+		if (it == health.end()) return true;
+		return it->second.failureRate <= MAX_FAILURE_RATE ||
+			std::chrono::steady_clock::now() - it->second.lastFailure >=
+				std::chrono::milliseconds(HEALTH_COOLDOWN_MS);
+	}
+
+	// Draining hosts finish their tasks but get no new ones.
+	bool isDraining(const string& hostName) {
+		auto it = hostStatus.find(hostName);
+		return drainingHosts.count(hostName) || (it != hostStatus.end() && it->second.draining);
+	}
+
+	bool isAvailable(const string& hostName) {
+		return isHealthy(hostName) && !isDraining(hostName);
+	}
+
+	// Number of idle processors of the host, 0 if its status is not known.
+	double spareCapacity(const string& hostName) {
+		auto it = hostStatus.find(hostName);
+		if (it == hostStatus.end()) return 0;
+		return std::max(0.0, it->second.cpuCount - it->second.loadAverage);
+	}
+
 	void startJudgings() {
-		std::vector<JudgeConnection> freeHosts;
-		std::set_difference(allJudgeHosts.begin(), allJudgeHosts.end(), usedJudgeHosts.begin(), usedJudgeHosts.end(), std::back_inserter(freeHosts));
+		// Pointers into allJudgeHosts, as connections can't be reassigned
+		// when sorted.
+		std::vector<const JudgeConnection*> freeHosts;
+		for(const JudgeConnection& conn: allJudgeHosts) {
+			if (!usedJudgeHosts.count(conn) && isAvailable(conn.host.name)) {
+				freeHosts.push_back(&conn);
+			}
+		}
+		// Slots are taken from the back, so hosts with most idle processors
+		// get tasks first.
+		std::stable_sort(freeHosts.begin(), freeHosts.end(),
+			[&](const JudgeConnection* a, const JudgeConnection* b) {
+				return spareCapacity(a->host.name) < spareCapacity(b->host.name);
+			});
 		cerr<<"counts: "<<freeHosts.size()<<' '<<pendingTasks.size()<<" ; "<<allJudgeHosts.size()<<' '<<usedJudgeHosts.size()<<'\n';
 		while(!freeHosts.empty() && !pendingTasks.empty()) {
 			cerr<<"Starting tasks\n";
-			UnitTask* task = pendingTasks.front();
-			pendingTasks.pop_front();
-			JudgeConnection host = freeHosts.back();
+			JudgeConnection host = *freeHosts.back();
 			freeHosts.pop_back();
+			UnitTask* task = pendingTasks.pop(host.host.name,
+				runningBackgroundTasks < MAX_RUNNING_BACKGROUND_TASKS);
+			// Remaining tasks may be pinned to other hosts.
+			if (!task) continue;
+			if (task->background) ++runningBackgroundTasks;
 			cerr<<"starting on host "<<host.host.name<<'\n';
-			std::thread(&UnitTask::execute, task, host, std::ref(*this)).detach();
+			workers.submit([=]() { task->execute(host, *this); });
 			usedJudgeHosts.insert(host);
 		}
 	}
 
-	void connectToJudgeHostLoop(JudgeHost host) {
-		while(1) {
-			try {
-				addConnectedJudgeHost(JudgeConnection(host));
-				cerr<<"Connected to jugehost "<<host.name<<'\n';
-				return;
-			} catch(const apache::thrift::transport::TTransportException& e) {
-//				cerr<<"Connecting to "<<host.name<<" failed: "<<e.what()<<'\n';
-				sleep(5);
+	// Try to connect to all slots of the judge host. On failure, retry later
+	// with exponential backoff.
+	void connectToJudgeHost(JudgeHost host, std::chrono::milliseconds delay) {
+		try {
+			shared_ptr<KnownFiles> knownFiles(new KnownFiles());
+			// Status is polled through its own connection, as the connections
+			// of the slots are used by tasks.
+			shared_ptr<PipelinedJudgeClient> statusPipeline = PipelinedJudgeClient::create(host.host, host.port);
+			vector<JudgeConnection> connections{JudgeConnection(host, 0, knownFiles, statusPipeline, &workers)};
+			JudgeConnection& first = connections[0];
+			int slots = std::max(1, (int)first.pipeline->getSlotCount(first.token).get());
+			for(int slot = 1; slot < slots; ++slot) {
+				connections.push_back(JudgeConnection(host, slot, knownFiles, statusPipeline, &workers));
+			}
+			{
+				auto lock = getLock();
+				hostFiles[host.name] = knownFiles;
+			}
+			for(const JudgeConnection& conn: connections) {
+				addConnectedJudgeHost(conn);
+			}
+			cerr<<"Connected to jugehost "<<host.name<<" with "<<slots<<" slots\n";
+			return;
+		} catch(const apache::thrift::transport::TTransportException& e) {
+//			cerr<<"Connecting to "<<host.name<<" failed: "<<e.what()<<'\n';
+		} catch(const apache::thrift::TException& e) {
+			cerr<<"Setting up judgehost "<<host.name<<" failed: "<<e.what()<<'\n';
+		}
+		std::chrono::milliseconds nextDelay =
+			std::min(2 * delay, std::chrono::milliseconds(MAX_RECONNECT_DELAY_MS));
+		timers.schedule(delay, [=]() { connectToJudgeHost(host, nextDelay); });
+	}
+
+	// Poll status of the connected hosts and draining flags of the hosts in
+	// the database, and schedule the next poll.
+	void pollStatus() {
+		try {
+			std::set<string> draining;
+			{
+				odb::transaction t(db::begin());
+				odb::result<JudgeHost> result = db::query<JudgeHost>();
+				for(const JudgeHost& host: result) {
+					if (host.draining) draining.insert(host.name);
+				}
+				t.commit();
 			}
+			std::map<string, JudgeConnection> connections;
+			{
+				auto lock = getLock();
+				for(const JudgeConnection& conn: allJudgeHosts) {
+					connections.insert({conn.host.name, conn});
+				}
+			}
+			// All hosts are asked at once, so a slow host doesn't delay
+			// the others.
+			std::map<string, std::future<protocol::JudgeStatus>> answers;
+			for(const auto& i: connections) {
+				answers[i.first] = i.second.statusPipeline->status(i.second.token, STATUS_DEADLINE_MS);
+			}
+			std::map<string, protocol::JudgeStatus> statuses;
+			for(auto& i: answers) {
+				try {
+					statuses[i.first] = i.second.get();
+				} catch(const apache::thrift::TException& e) {
+					cerr<<"Polling status of judge "<<i.first<<" failed: "<<e.what()<<'\n';
+				}
+			}
+			auto lock = getLock();
+			for(const auto& i: statuses) {
+				bool wasDraining = isDraining(i.first);
+				bool nowDraining = draining.count(i.first) || i.second.draining;
+				if (wasDraining != nowDraining) {
+					cerr<<"judge host "<<i.first<<(nowDraining ? " is draining\n" : " is no longer draining\n");
+				}
+				// Staging of run inputs since the last poll.
+				const protocol::CacheStats& cache = i.second.stagingCache;
+				auto old = hostStatus.find(i.first);
+				int64_t hits = cache.hits;
+				int64_t misses = cache.misses;
+				if (old != hostStatus.end()) {
+					hits -= old->second.stagingCache.hits;
+					misses -= old->second.stagingCache.misses;
+				}
+				if (hits < 0 || misses < 0) {
+					// The counters were reset by a restart of the judge.
+					hits = cache.hits;
+					misses = cache.misses;
+				}
+				if (hits > 0 || misses > 0) {
+					cerr<<"judge host "<<i.first<<" staged inputs with "<<hits<<" hits and "<<misses<<" misses, "
+						<<cache.bytes<<" of "<<cache.byteBudget<<" bytes used\n";
+				}
+			}
+			drainingHosts.swap(draining);
+			hostStatus.swap(statuses);
+			condition.notify_one();
+		} catch(const std::exception& e) {
+			cerr<<"Polling judge status failed: "<<e.what()<<'\n';
 		}
+		timers.schedule(std::chrono::milliseconds(STATUS_POLL_INTERVAL_MS), [this]() { pollStatus(); });
 	}
 
 	std::condition_variable condition;
 	std::mutex mutex;
 
-	std::deque<UnitTask*> pendingTasks;
+	TaskScheduler pendingTasks;
+	size_t runningBackgroundTasks = 0;
 
 	std::set<JudgeConnection> usedJudgeHosts;
 	std::set<JudgeConnection> allJudgeHosts;
+	// Files known to exist on each host by host name.
+	std::map<string, shared_ptr<KnownFiles>> hostFiles;
+	std::map<string, HostHealth> health;
+	// Latest status of each host that answered the last poll.
+	std::map<string, protocol::JudgeStatus> hostStatus;
+	// Hosts marked as draining in the database.
+	std::set<string> drainingHosts;
+
+	// Started last, after everything it uses has been constructed.
+	std::thread mainThread;
 };
 
 ReturnConnection::~ReturnConnection() {
-	master.returnConnection(connection);
+	master.returnConnection(connection, background);
 }
 
-class RunTestGroup: public UnitTask {
-public:
-	RunTestGroup(SubmissionPtr submission, shared_ptr<TestGroup> testGroup):
-		submissionID(submission->id), testGroupID(testGroup->id) {}
+void UnitTask::execute(JudgeConnection connection, JudgeMaster& master) {
+	this->connection.reset(new JudgeConnection(connection));
+	this->master = &master;
+	step([this]() { run(); });
+}
+
+void UnitTask::step(std::function<void()> body) {
+	std::function<void()> startRun;
+	bool retry = false;
+	bool hostFailed = false;
+	{
+		// Loaded objects have circular relationships, which need a session.
+		odb::session session;
+		try {
+			body();
+			startRun.swap(nextRun);
+		} catch(const ::apache::thrift::TException& e) {
+			namespace P = protocol;
+			printErrorForTypes<P::InternalError, P::InvalidDataError, P::AuthError, P::DockerError>(e);
+			retry = willRetry(e);
+			hostFailed = isInfrastructureFailure(e);
+			handleFailure(&e);
+		} catch(const std::exception& e) {
+			cerr<<"Internal judging exception "<<e.what()<<'\n';
+			handleFailure(nullptr);
+		} catch(...) {
+			cerr<<"Unknown judging exception\n";
+			handleFailure(nullptr);
+		}
+	}
+	if (startRun) {
+		// The task is not touched after this, as it may already be
+		// continued by another worker.
+		startRun();
+		return;
+	}
+	nextRun = nullptr;
+	finish(retry, hostFailed);
+}
+
+void UnitTask::handleFailure(const ::apache::thrift::TException* e) {
+	try {
+		onFailure(e);
+	} catch(const std::exception& e) {
+		cerr<<"Handling failure of judging task failed: "<<e.what()<<'\n';
+	}
+}
+
+void UnitTask::finish(bool retry, bool hostFailed) {
+	unique_ptr<UnitTask> self(this);
+	// Copied, as a retried task may get a new connection right away.
+	JudgeConnection connection = *this->connection;
+	JudgeMaster& master = *this->master;
+	ReturnConnection ret{master, connection, background};
+	(void)ret;
+	master.reportOutcome(connection.host.name, !hostFailed);
+	if (retry) {
+		++attempts;
+		failedHosts.insert(connection.host.name);
+		cerr<<"retrying task, attempt "<<attempts + 1<<'\n';
+		master.retryTask(self.release());
+		return;
+	}
+	try {
+		if (queueEntryID) {
+			odb::transaction t(db::begin());
+			eraseQueueEntry();
+			t.commit();
+		}
+	} catch(const std::exception& e) {
+		cerr<<"Removing finished task from queue failed: "<<e.what()<<'\n';
+	}
+}
+
+// Find cache or memo entry by its unique key.
+template<class T>
+optional<T> findByKey(const string& key) {
+	odb::transaction t(db::begin());
+	odb::result<T> res = db::query<T>(odb::query<T>::key == key);
+	if (res.empty()) return optional<T>();
+	return *res.begin();
+}
+
+// Store cache or memo entry, ignoring failure if an entry with the same key
+// was stored concurrently.
+template<class T>
+void storeByKey(T& entry) {
+	try {
+		odb::transaction t(db::begin());
+		db::persist(entry);
+		t.commit();
+	} catch(const odb::exception& e) {
+		cerr<<"Storing entry "<<entry.key<<" failed: "<<e.what()<<'\n';
+	}
+}
+
+// Durations of recent shard runs relative to their total time limit, used to
+// decide when a run is slow enough to be hedged.
+class LatencyTracker {
+public:
+	static LatencyTracker& instance() {
+		static LatencyTracker tracker;
+		return tracker;
+	}
+
+	void add(double ratio) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (samples.size() < SAMPLE_COUNT) {
+			samples.push_back(ratio);
+		} else {
+			samples[next] = ratio;
+		}
+		next = (next + 1) % SAMPLE_COUNT;
+	}
+
+	// 99th percentile of the ratios, or nothing until there are enough
+	// samples.
+	optional<double> p99() {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (samples.size() < MIN_SAMPLES) return optional<double>();
+		vector<double> sorted = samples;
+		auto pos = sorted.begin() + sorted.size() * 99 / 100;
+		std::nth_element(sorted.begin(), pos, sorted.end());
+		return *pos;
+	}
+
+private:
+	static const size_t SAMPLE_COUNT = 1000;
+	static const size_t MIN_SAMPLES = 100;
+
+	std::mutex mutex;
+	vector<double> samples;
+	size_t next = 0;
+};
+
+// Whether slow shards are hedged by running a copy on another host.
+std::atomic<bool> hedgingEnabled(false);
+
+// Submissions whose remaining tests need not be run, because a test of the
+// group failed, or a test of any group in a task that stops on first
+// failure. Kept only in memory, so after a restart all tests are run.
+class Cancellations {
+public:
+	static Cancellations& instance() {
+		static Cancellations cancellations;
+		return cancellations;
+	}
+
+	// Group 0 cancels all groups of the submission.
+	void cancel(ID submissionID, ID groupID) {
+		std::lock_guard<std::mutex> lock(mutex);
+		cancelled[submissionID].insert(groupID);
+	}
+	bool isCancelled(ID submissionID, ID groupID) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = cancelled.find(submissionID);
+		return it != cancelled.end() && (it->second.count(0) || it->second.count(groupID));
+	}
+	void forget(ID submissionID) {
+		std::lock_guard<std::mutex> lock(mutex);
+		cancelled.erase(submissionID);
+	}
+
+private:
+	std::mutex mutex;
+	std::map<ID, std::set<ID>> cancelled;
+};
+
+// Runs a shard of the tests of a group. Shards of a group run in parallel
+// on any free slots, and stop once a sibling has failed.
+class RunTestGroup: public UnitTask {
+public:
+	// Maximum number of tests in a shard.
+	static const int SHARD_SIZE = 8;
+
+	// Runs testCount tests of the group starting from firstTest, or all
+	// tests from firstTest on if testCount is 0.
+	RunTestGroup(ID submissionID, ID testGroupID, int firstTest = 0, int testCount = 0):
+		submissionID(submissionID), testGroupID(testGroupID),
+		firstTest(firstTest), testCount(testCount) {}
+
+	// List the binary and test data of the shard in files. Must be called in
+	// a transaction.
+	void listFiles(const Submission& submission, const TestGroup& group) {
+		files.clear();
+		files.push_back(submission.program.binary.hash);
+		for(shared_ptr<TestCase> test: testsOfShard(group)) {
+			files.push_back(test->input.hash);
+			files.push_back(test->output.hash);
+		}
+	}
 protected:
 	void run() override {
-		odb::session session;
-		shared_ptr<TestGroup> group;
-		shared_ptr<Submission> submission;
+		vector<shared_ptr<TestCase>> shardTests;
 		{
+			// Under the lock of the submission, so that the results of a
+			// hedged copy claiming the shard are stored after the old ones
+			// are erased.
+			auto lock = getLock(submissionID);
+			if (claim && claim->load()) {
+				// The other copy finished the shard and removed the queue
+				// entry.
+				queueEntryID = 0;
+				return;
+			}
 			odb::transaction t(db::begin());
 			group = db::load<TestGroup>(testGroupID);
 			submission = db::load<Submission>(submissionID);
+			shardTests = testsOfShard(*group);
+			// A hedged copy runs while the original may be storing results.
+			if (!isHedge) eraseOldResults(shardTests);
+			t.commit();
 		}
-		try {
-			SubmissionUpdate update{submission, 0};
-			bool allOK = 1;
-			for(shared_ptr<TestCase> test: group->tests) {
-				Result result = runForInput(submission, test);
-				if (result.output && result.status == ResultStatus::CORRECT) {
-					allOK &= evaluateOutput(submission, result);
-				} else {
-					allOK = 0;
-				}
-				odb::transaction t(db::begin());
-				db::persist(result);
-				t.commit();
-				if (!allOK) break;
+		update.reset(new SubmissionUpdate{this, submission, group, {}, false});
+		TaskPtr task = submission->task;
+		// Take results from memos where possible and run the other tests.
+		runTests.clear();
+		failed = false;
+		for(shared_ptr<TestCase> test: shardTests) {
+			optional<Result> memoized = findMemoizedResult(submission, test);
+			if (!memoized) {
+				runTests.push_back(test);
+				continue;
 			}
-			update.score = allOK ? group->points : 0;
-		} catch(const ::apache::thrift::TException&) {
-			auto lock = getLock();
+			update->results.push_back(*memoized);
+			if (memoized->status != ResultStatus::CORRECT) {
+				failed = true;
+				break;
+			}
+		}
+		cerr<<"memoized "<<update->results.size()<<" results, running "<<runTests.size()<<" tests\n";
+		timeBudget = runTests.size() * task->timeInSeconds;
+		// Retried shards keep the claim of their first attempt.
+		if (hedgingEnabled && !claim && !runTests.empty()) scheduleHedge(timeBudget);
+		startTime = std::chrono::steady_clock::now();
+		nextTest = 0;
+		stopped = false;
+		runNextTests();
+	}
+
+	void onFailure(const ::apache::thrift::TException* e) override {
+		if (!update) return;
+		if (isHedge || (e && willRetry(*e))) {
+			// The shard is run again from the start on another host, or
+			// the original copy of the hedged shard finishes it.
+			dismiss(*update);
+		} else if (e && !(claim && claim->load())) {
+			// Unless the hedged copy finished the shard, which leaves the
+			// submission as stored by the copy.
+			auto lock = getLock(submissionID);
 			odb::transaction t(db::begin());
 			submission->status = SubmissionStatus::ERROR;
 			db::update(submission);
 			t.commit();
-			throw;
 		}
+		update.reset();
+	}
+
+	// A failed hedged copy is dropped, as the original is still running.
+	bool retryable() const override {
+		return !isHedge;
+	}
+	optional<PendingJudgeTask> queueEntry() override {
+		PendingJudgeTask entry;
+		entry.type = JudgeTaskType::RUN_TEST_GROUP;
+		entry.target = submissionID;
+		entry.testGroup = testGroupID;
+		entry.firstTest = firstTest;
+		entry.testCount = testCount;
+		return entry;
 	}
+
 private:
 	ID submissionID;
 	ID testGroupID;
+	int firstTest;
+	int testCount;
+	// Shared by the shard and its hedged copy, set by the first to finish.
+	shared_ptr<std::atomic<bool>> claim;
+	bool isHedge = false;
+
+	// State of the shard between its steps.
+	shared_ptr<TestGroup> group;
+	SubmissionPtr submission;
+	vector<shared_ptr<TestCase>> runTests;
+	size_t nextTest = 0;
+	bool failed = false;
+	bool stopped = false;
+	double timeBudget = 0;
+	std::chrono::steady_clock::time_point startTime;
 
-	Result runForInput(SubmissionPtr submission, shared_ptr<TestCase> test) {
-		shared_ptr<Language> lang = submission->program.language;
+	// Tests are run a few at a time, so that the shard stops soon after a
+	// sibling has failed or the hedged copy has finished. Stores the results
+	// once all tests have been run.
+	void runNextTests() {
+		TaskPtr task = submission->task;
+		Cancellations& cancellations = Cancellations::instance();
+		if (!failed && nextTest < runTests.size()) {
+			if (cancellations.isCancelled(submissionID, testGroupID) || (claim && claim->load())) {
+				cerr<<"skipping cancelled tests of group "<<testGroupID<<'\n';
+				stopped = true;
+			} else {
+				size_t begin = nextTest;
+				size_t end = std::min(runTests.size(), begin + CANCEL_CHECK_INTERVAL);
+				nextTest = end;
+				vector<protocol::BatchTest> tests;
+				for(size_t i = begin; i < end; ++i) {
+					protocol::BatchTest batchTest;
+					batchTest.inputHash = runTests[i]->input.hash;
+					batchTest.correctHash = runTests[i]->output.hash;
+					tests.push_back(batchTest);
+				}
+				await<vector<protocol::BatchResult>>(
+					[=](JudgeConnection::Done<vector<protocol::BatchResult>> done) {
+						connection->runBatchOnJudge(
+							submission->program.language->runner,
+							submission->program.binary.hash,
+							tests,
+							task->timeInSeconds,
+							task->memoryInBytes,
+							task->evaluator.language->runner,
+							task->evaluator.binary.hash,
+							EVALUATOR_TIME_LIMIT,
+							EVALUATOR_MEMORY_LIMIT,
+							true,
+							makeChecker(*task),
+							done);
+					},
+					[=](JudgeConnection::Answer<vector<protocol::BatchResult>> answer) {
+						addResults(begin, tests.size(), answer());
+						runNextTests();
+					});
+				return;
+			}
+		}
+		if (failed) {
+			cancellations.cancel(submissionID, task->stopOnFirstFailure ? 0 : testGroupID);
+		} else if (!stopped && timeBudget > 0) {
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+			LatencyTracker::instance().add(elapsed.count() / timeBudget);
+		}
+		update.reset();
+	}
+
+	// Add the results of count tests from runTests[begin] on.
+	void addResults(size_t begin, size_t count, const vector<protocol::BatchResult>& batch) {
+		if (batch.size() > count) throw invalidBatch("Judge returned too many results.");
+		for(size_t i = 0; i < batch.size(); ++i) {
+			Result result = makeResult(submission, runTests[begin + i], batch[i].run);
+			memoizeRun(submission, result);
+			if (result.status == ResultStatus::CORRECT) {
+				if (batch[i].__isset.evaluation) {
+					result.status = resultStatus(evaluationVerdict(batch[i].evaluation));
+					memoizeEvaluation(submission, result);
+				} else {
+					result.status = ResultStatus::INTERNAL_ERROR;
+				}
+			}
+			failed |= result.status != ResultStatus::CORRECT;
+			update->results.push_back(result);
+		}
+		// The judge stops a batch only at a test that failed.
+		if (!failed && batch.size() != count) throw invalidBatch("Judge stopped a batch early.");
+	}
+
+	static const size_t CANCEL_CHECK_INTERVAL = 4;
+	static const int MIN_HEDGE_DELAY_MS = 2000;
+
+	// Run a copy of the shard on another host if this one is still running
+	// when runs taking the given time limit are usually finished.
+	void scheduleHedge(double timeBudget) {
+		optional<double> p99 = LatencyTracker::instance().p99();
+		if (!p99) return;
+		int64_t delay = std::max<int64_t>(MIN_HEDGE_DELAY_MS, *p99 * timeBudget * 1000);
+		claim = std::make_shared<std::atomic<bool>>(false);
+		// Copied for the timer, which may fire after this task is deleted.
+		shared_ptr<std::atomic<bool>> sharedClaim = claim;
+		ID submissionID = this->submissionID;
+		ID testGroupID = this->testGroupID;
+		int firstTest = this->firstTest;
+		int testCount = this->testCount;
+		TaskPriority priority = this->priority;
+		ID userID = this->userID;
+		vector<string> files = this->files;
+		ID queueEntryID = this->queueEntryID;
+		JudgeMaster* master = this->master;
+		string host = connection->host.name;
+		master->schedule(std::chrono::milliseconds(delay), [=]() {
+			if (sharedClaim->load()) return;
+			RunTestGroup* copy = new RunTestGroup(submissionID, testGroupID, firstTest, testCount);
+			copy->priority = priority;
+			copy->userID = userID;
+			copy->files = files;
+			copy->queueEntryID = queueEntryID;
+			copy->claim = sharedClaim;
+			copy->isHedge = true;
+			master->addHedgeTask(copy, host);
+		});
+	}
+
+	vector<shared_ptr<TestCase>> testsOfShard(const TestGroup& group) {
+		size_t begin = std::min((size_t)firstTest, group.tests.size());
+		size_t end = testCount ? std::min(begin + testCount, group.tests.size()) : group.tests.size();
+		return vector<shared_ptr<TestCase>>(group.tests.begin() + begin, group.tests.begin() + end);
+	}
+
+	static vector<ID> testIDs(const vector<shared_ptr<TestCase>>& tests) {
+		vector<ID> ids;
+		for(shared_ptr<TestCase> test: tests) {
+			ids.push_back(test->id);
+		}
+		return ids;
+	}
+
+	// Remove results stored by an earlier run of the shard that was
+	// interrupted by a restart.
+	void eraseOldResults(const vector<shared_ptr<TestCase>>& tests) {
+		vector<ID> ids = testIDs(tests);
+		typedef odb::query<Result> query;
+		db::eraseQuery<Result>(query::submission == submissionID &&
+			query::testCase.in_range(ids.begin(), ids.end()));
+	}
+
+	// Number of stored correct results of the group. Must be called in a
+	// transaction.
+	size_t countCorrectResults(const TestGroup& group) {
+		vector<ID> ids = testIDs(group.tests);
+		typedef odb::query<Result> query;
+		odb::result<Result> res = db::query<Result>(query::submission == submissionID &&
+			query::testCase.in_range(ids.begin(), ids.end()) &&
+			query::status == ResultStatus::CORRECT);
+		return std::distance(res.begin(), res.end());
+	}
+
+	string runMemoKey(SubmissionPtr submission, shared_ptr<TestCase> test) {
+		stringstream key;
+		key << submission->program.language->runner.identity() << '\n'
+			<< submission->program.binary.hash << '\n'
+			<< test->input.hash << '\n'
+			<< submission->task->memoryInBytes;
+		return hashString(key.str());
+	}
+
+	static protocol::Checker makeChecker(const Task& task) {
+		protocol::Checker checker;
+		switch(task.checker) {
+		case CheckerType::CUSTOM:
+			checker.type = protocol::CheckerType::CUSTOM;
+			break;
+		case CheckerType::EXACT:
+			checker.type = protocol::CheckerType::EXACT;
+			break;
+		case CheckerType::IGNORE_WHITESPACE:
+			checker.type = protocol::CheckerType::IGNORE_WHITESPACE;
+			break;
+		case CheckerType::FLOAT:
+			checker.type = protocol::CheckerType::FLOAT;
+			break;
+		}
+		checker.absoluteEpsilon = task.absoluteEpsilon;
+		checker.relativeEpsilon = task.relativeEpsilon;
+		return checker;
+	}
+
+	string evaluationMemoKey(SubmissionPtr submission, const Result& result) {
+		const Task& task = *submission->task;
+		stringstream key;
+		if (task.checker == CheckerType::CUSTOM) {
+			key << task.evaluator.language->runner.identity() << '\n'
+				<< task.evaluator.binary.hash << '\n';
+		} else {
+			key.precision(17);
+			key << "builtin " << (int)task.checker << ' '
+				<< task.absoluteEpsilon << ' ' << task.relativeEpsilon << '\n';
+		}
+		key << result.output.hash << '\n'
+			<< result.testCase->output.hash << '\n'
+			<< result.testCase->input.hash;
+		return hashString(key.str());
+	}
+
+	// Get result of the test from memos, if both the run and the evaluation
+	// of its output are memoized.
+	optional<Result> findMemoizedResult(SubmissionPtr submission, shared_ptr<TestCase> test) {
+		optional<RunMemo> run = findByKey<RunMemo>(runMemoKey(submission, test));
+		if (!run || !run->reusableWith(submission->task->timeInSeconds)) {
+			return optional<Result>();
+		}
+		Result res;
+		res.submission = submission;
+		res.testCase = test;
+		res.status = run->status;
+		res.output = run->output;
+		res.errOutput = run->errOutput;
+		res.timeInSeconds = run->timeInSeconds;
+		res.memoryInBytes = run->memoryInBytes;
+		if (res.status == ResultStatus::CORRECT) {
+			optional<EvaluationMemo> evaluation = findByKey<EvaluationMemo>(evaluationMemoKey(submission, res));
+			if (!evaluation) return optional<Result>();
+			res.status = evaluation->status;
+		}
+		return res;
+	}
+
+	// Memoize run before its output is evaluated.
+	void memoizeRun(SubmissionPtr submission, const Result& result) {
+		if (result.status == ResultStatus::INTERNAL_ERROR) return;
+		RunMemo memo;
+		memo.key = runMemoKey(submission, result.testCase);
+		memo.timeLimit = submission->task->timeInSeconds;
+		memo.status = result.status;
+		memo.output = result.output;
+		memo.errOutput = result.errOutput;
+		memo.timeInSeconds = result.timeInSeconds;
+		memo.memoryInBytes = result.memoryInBytes;
+		storeByKey(memo);
+	}
+
+	void memoizeEvaluation(SubmissionPtr submission, const Result& result) {
+		if (result.status != ResultStatus::CORRECT && result.status != ResultStatus::WRONG_ANSWER) return;
+		EvaluationMemo memo;
+		memo.key = evaluationMemoKey(submission, result);
+		memo.status = result.status;
+		storeByKey(memo);
+	}
+
+	static constexpr double EVALUATOR_TIME_LIMIT = 1.0;
+	static const int64_t EVALUATOR_MEMORY_LIMIT = 100<<20;
+
+	Result makeResult(SubmissionPtr submission, shared_ptr<TestCase> test, const protocol::RunResult& result) {
 		TaskPtr task = submission->task;
-		StringMap inputs;
-		inputs["binary"] = submission->program.binary.hash;
-		inputs["input"] = test->input.hash;
-		auto result = connection->runOnJudge(lang->runner, inputs, task->timeInSeconds, task->memoryInBytes);
 		StringMap resMap = asMap(result);
 		Result res;
-		res.status = ResultStatus::CORRECT;
+		res.status = resultStatus(runVerdict(result, task->timeInSeconds));
 		res.submission = submission;
 		res.testCase = test;
 		res.timeInSeconds = result.timeInSeconds;
 		res.memoryInBytes = result.memoryInBytes;
 		if (resMap.count("stdout")) {
 			res.output.hash = resMap["stdout"];
-		} else {
-			res.status = ResultStatus::INTERNAL_ERROR;
 		}
 		if (resMap.count("stderr")) {
 			res.errOutput.hash = resMap["stderr"];
 		}
-		if (resMap.count("status")) {
-			auto in = openFileByHash(resMap["status"]);
-			int status=666;
-			*in >> status;
-			if (status != 1) {
-				res.status = ResultStatus::RUNTIME_ERROR;
-			}
-		}
-		if (res.timeInSeconds > task->timeInSeconds) {
-			res.status = ResultStatus::TIME_LIMIT;
-		}
 		return res;
 	}
 
-	bool evaluateOutput(SubmissionPtr submission, Result& result) {
-		result.status = ResultStatus::INTERNAL_ERROR;
-		TaskPtr task = submission->task;
-		Sandbox sandbox = task->evaluator.language->runner;
-		StringMap inputs;
-		inputs["binary"] = task->evaluator.binary.hash;
-		inputs["output"] = result.output.hash;
-		inputs["input"] = result.testCase->input.hash;
-		inputs["correct"] = result.testCase->output.hash;
-		StringMap resMap = asMap(connection->runOnJudge(sandbox, inputs, 1.0, 100<<20));
-		cerr<<"result file "<<resMap.count("stdout")<<'\n';
-		bool ok = 0;
-		if (!resMap.count("stdout")) {
-			result.status = ResultStatus::INTERNAL_ERROR;
-		} else {
-			string resStr = readFileByHash(resMap["stdout"]);
-			cerr<<"result string "<<resStr<<'\n';
-			optional<int> ores = stringToInteger<int>(resStr);
-			if (!ores) {
-				result.status = ResultStatus::INTERNAL_ERROR;
-			} else {
-				ok = *ores;
-				result.status = ok ? ResultStatus::CORRECT : ResultStatus::WRONG_ANSWER;
-			}
+	static ResultStatus resultStatus(TestVerdict verdict) {
+		switch(verdict) {
+		case TestVerdict::ACCEPTED: return ResultStatus::CORRECT;
+		case TestVerdict::WRONG_ANSWER: return ResultStatus::WRONG_ANSWER;
+		case TestVerdict::TIME_LIMIT: return ResultStatus::TIME_LIMIT;
+		case TestVerdict::RUNTIME_ERROR: return ResultStatus::RUNTIME_ERROR;
+		case TestVerdict::INTERNAL_ERROR: return ResultStatus::INTERNAL_ERROR;
 		}
-		return ok;
+		return ResultStatus::INTERNAL_ERROR;
+	}
+
+	// Error for a batch that breaks the protocol. The shard is run again on
+	// another host.
+	static protocol::InternalError invalidBatch(const string& msg) {
+		protocol::InternalError error;
+		error.msg = msg;
+		return error;
 	}
 
+	// Stores the results and counts the shard as finished when destroyed.
+	// The shard is removed from the database queue in the same transaction,
+	// so that it is never counted twice. Results are stored under the lock
+	// of the submission, so exactly one shard, the one that stores the last
+	// correct result of the group, gives the points of the group.
 	struct SubmissionUpdate {
+		RunTestGroup* owner;
 		SubmissionPtr submission;
-		int score;
+		shared_ptr<TestGroup> group;
+		vector<Result> results;
+		// Set when the shard is run again, so that it is not yet finished.
+		bool dismissed;
 		~SubmissionUpdate() {
-			auto lock = getLock();
+			if (dismissed) return;
+			if (owner->claim && owner->claim->exchange(true)) {
+				// The other copy of the hedged shard finished first and
+				// removed the queue entry.
+				owner->queueEntryID = 0;
+				return;
+			}
+			auto lock = getLock(submission->id);
 			odb::transaction t(db::begin());
 			db::reload(submission);
+			size_t correct = 0;
+			for(Result& result: results) {
+				db::persist(result);
+				if (result.status == ResultStatus::CORRECT) ++correct;
+			}
+			if (group->tests.empty() ||
+				(correct > 0 && owner->countCorrectResults(*group) == group->tests.size()))
+			{
+				submission->score += group->points;
+			}
 			--submission->missingResults;
-			submission->score += score;
-			if (submission->missingResults == 0 && submission->status == SubmissionStatus::JUDGING) {
-				submission->status = SubmissionStatus::READY;
+			if (submission->missingResults == 0) {
+				Cancellations::instance().forget(submission->id);
+				if (submission->status == SubmissionStatus::JUDGING) {
+					submission->status = SubmissionStatus::READY;
+				}
 			}
 			db::update(submission);
+			if (owner->queueEntryID) owner->eraseQueueEntry();
 			t.commit();
 		}
 	};
 
-	static std::unique_lock<std::mutex> getLock() {
-		return std::unique_lock<std::mutex>(submissionMutex);
+	// Leave the shard unfinished, without storing results or claiming it.
+	void dismiss(SubmissionUpdate& update) {
+		update.dismissed = true;
+		// The queue entry belongs to the original copy.
+		if (isHedge) queueEntryID = 0;
 	}
-	// TODO: make per-submission mutex
-	static std::mutex submissionMutex;
-};
-std::mutex RunTestGroup::submissionMutex;
-
-template<class Owner, class Program>
-void compileProgram(shared_ptr<Owner> owner, Program& program, JudgeConnection connection) {
-	shared_ptr<Language> lang = program.language;
-	if (!lang) throw Error("Compiled program is missing language.");
-	StringMap inputs;
-	inputs["source"] = program.source.hash;
-	cerr<<"compiling with lang "<<lang->name<<" program "<<program.source.hash<<'\n';
-	StringMap result = asMap(connection.runOnJudge(lang->compiler, inputs, 10.0, 150<<20));
-	bool changed = 0;
-	if (result.count("stderr") || result.count("stderr")) {
-		program.compileMessage = result["stdout"] + result["stderr"];
-		changed = 1;
-	}
-	if (result.count("binary")) {
-		program.binary.hash = result["binary"];
-		changed = 1;
-	}
-	cerr<<"changed: "<<changed<<' '<<program.binary.hash<<' '<<program.compileMessage<<'\n';
-	if (changed) {
-		odb::transaction t(db::begin());
-		db::update(owner);
-		t.commit();
+
+	// Updates of one submission are serialized by a mutex chosen by the
+	// submission ID, so that groups of different submissions rarely wait
+	// for each other.
+	static std::unique_lock<std::mutex> getLock(ID submissionID) {
+		return std::unique_lock<std::mutex>(submissionMutexes[submissionID % SUBMISSION_MUTEX_COUNT]);
 	}
+	static const size_t SUBMISSION_MUTEX_COUNT = 64;
+	static std::mutex submissionMutexes[SUBMISSION_MUTEX_COUNT];
+
+	// Stores the results when reset.
+	unique_ptr<SubmissionUpdate> update;
+};
+std::mutex RunTestGroup::submissionMutexes[RunTestGroup::SUBMISSION_MUTEX_COUNT];
+
+string compileCacheKey(const string& sourceHash, const Sandbox& compiler) {
+	return sourceHash + "_" + hashString(compiler.identity());
 }
 
-class CompileEvaluatorTask: public UnitTask {
+// Task that compiles programs on the judge.
+class CompilingTask: public UnitTask {
+protected:
+	// Compile the program of owner, and continue the task with then once it
+	// is stored. The compiled program is taken from the compile cache if
+	// possible.
+	template<class Owner, class Program>
+	void compileProgram(shared_ptr<Owner> owner, Program& program, std::function<void()> then) {
+		shared_ptr<Language> lang = program.language;
+		if (!lang) throw Error("Compiled program is missing language.");
+		string cacheKey = compileCacheKey(program.source.hash, lang->compiler);
+		optional<CompileCacheEntry> cached = findByKey<CompileCacheEntry>(cacheKey);
+		if (cached) {
+			cerr<<"compile cache hit for program "<<program.source.hash<<'\n';
+			program.binary = cached->binary;
+			program.compileMessage = cached->compileMessage;
+			odb::transaction t(db::begin());
+			db::update(owner);
+			t.commit();
+			then();
+			return;
+		}
+		StringMap inputs;
+		inputs["source"] = program.source.hash;
+		cerr<<"compiling with lang "<<lang->name<<" program "<<program.source.hash<<'\n';
+		Program* compiled = &program;
+		await<protocol::RunResult>(
+			[=](JudgeConnection::Done<protocol::RunResult> done) {
+				connection->runOnJudge(lang->compiler, inputs, 10.0, 150<<20, done);
+			},
+			[=](JudgeConnection::Answer<protocol::RunResult> answer) {
+				storeCompileResult(owner, *compiled, cacheKey, answer());
+				then();
+			});
+	}
+
+private:
+	template<class Owner, class Program>
+	static void storeCompileResult(
+		shared_ptr<Owner> owner,
+		Program& program,
+		const string& cacheKey,
+		const protocol::RunResult& run
+	) {
+		StringMap result = asMap(run);
+		bool changed = 0;
+		if (result.count("stderr") || result.count("stderr")) {
+			program.compileMessage = result["stdout"] + result["stderr"];
+			changed = 1;
+		}
+		if (result.count("binary")) {
+			program.binary.hash = result["binary"];
+			changed = 1;
+		}
+		cerr<<"changed: "<<changed<<' '<<program.binary.hash<<' '<<program.compileMessage<<'\n';
+		if (changed) {
+			odb::transaction t(db::begin());
+			db::update(owner);
+			t.commit();
+		}
+		// Failures are not cached, as they may be caused by the judge host.
+		if (result.count("binary")) {
+			CompileCacheEntry entry;
+			entry.key = cacheKey;
+			entry.binary = program.binary;
+			entry.compileMessage = program.compileMessage;
+			storeByKey(entry);
+		}
+	}
+};
+
+class CompileEvaluatorTask: public CompilingTask {
 public:
-	CompileEvaluatorTask(ID id): id(id) {}
+	CompileEvaluatorTask(ID id): id(id) {
+		// Judging of the task's submissions waits for the evaluator.
+		priority = TaskPriority::LIVE_CONTEST;
+	}
 	void run() override {
-		odb::session session;
 		shared_ptr<Task> task;
 		{
 			odb::transaction t(db::begin());
 			task = db::load<Task>(id);
 		}
-		compileProgram(task, task->evaluator, *connection);
+		compileProgram(task, task->evaluator, []() {});
+	}
+protected:
+	optional<PendingJudgeTask> queueEntry() override {
+		PendingJudgeTask entry;
+		entry.type = JudgeTaskType::COMPILE_EVALUATOR;
+		entry.target = id;
+		return entry;
 	}
 private:
 	ID id;
 };
 
-class CompileAndRunTask: public UnitTask {
+// Uploads test data to one judge host ahead of judging, so that the first
+// submissions don't wait for it. Each task sends a bounded amount and queues
+// the rest as a new task, so that it holds the slot only briefly.
+class PrefetchTask: public UnitTask {
 public:
-	CompileAndRunTask(SubmissionPtr submission): submissionID(submission->id) {
-	}
+	PrefetchTask(vector<string> hashes): hashes(move(hashes)) {}
 
 protected:
 	void run() override {
-		odb::session session;
-		SubmissionPtr submission;
+		vector<string> rest = connection->prefetchFiles(hashes, throttle(), MAX_BYTES_PER_TASK);
+		if (!rest.empty()) {
+			master->addBackgroundTask(new PrefetchTask(move(rest)), connection->host.name);
+		}
+	}
+
+	// Upcoming contests are prefetched again after a restart.
+	optional<PendingJudgeTask> queueEntry() override {
+		return optional<PendingJudgeTask>();
+	}
+
+	// Files are sent on demand if prefetching fails.
+	bool retryable() const override { return false; }
+
+private:
+	vector<string> hashes;
+
+	static const int64_t BYTES_PER_SECOND = 8 << 20;
+	// About a second of the rate, so that a task waiting for its share of
+	// the shared throttle holds the slot only for a few seconds.
+	static const int64_t MAX_BYTES_PER_TASK = BYTES_PER_SECOND;
+
+	// Shared by all hosts, so that prefetching leaves bandwidth of the
+	// server for live judging.
+	static TokenBucket& throttle() {
+		static TokenBucket bucket(BYTES_PER_SECOND, BYTES_PER_SECOND);
+		return bucket;
+	}
+};
+
+// Files needed to judge submissions to the tasks of the contest, inputs of
+// each test first.
+vector<string> contestFiles(ID contestID) {
+	vector<string> hashes;
+	std::unordered_set<string> seen;
+	auto add = [&](const string& hash) {
+		if (!hash.empty() && seen.insert(hash).second) hashes.push_back(hash);
+	};
+	odb::session session;
+	odb::transaction t(db::begin());
+	shared_ptr<Contest> contest = db::load<Contest>(contestID);
+	db::load(*contest, contest->sec);
+	for(TaskPtr task: contest->tasks) {
+		db::load(*task, task->sec);
+		if (task->checker == CheckerType::CUSTOM) add(task->evaluator.binary.hash);
+		for(shared_ptr<TestGroup> group: task->testGroups) {
+			for(shared_ptr<TestCase> test: group->tests) {
+				add(test->input.hash);
+				add(test->output.hash);
+			}
+		}
+	}
+	t.commit();
+	return hashes;
+}
+
+// Queue prefetch of the files to the given hosts.
+void prefetchFiles(const vector<string>& hashes, const std::set<string>& hostNames) {
+	if (hashes.empty()) return;
+	for(const string& hostName: hostNames) {
+		JudgeMaster::instance().addBackgroundTask(new PrefetchTask(hashes), hostName);
+	}
+}
+
+// Contests are prefetched this long before they begin.
+const long long PREFETCH_LEAD_TIME = 15 * 60;
+const std::chrono::milliseconds CONTEST_CHECK_INTERVAL(60 * 1000);
+
+// Hosts that each upcoming or running contest has been prefetched to. Only
+// accessed by the contest check timer.
+std::map<ID, std::set<string>> prefetchedHosts;
+
+// Prefetch contests that are about to begin or running to the connected
+// hosts that don't have them yet, including hosts connected late.
+void checkUpcomingContests() {
+	try {
+		long long now = currentTime();
+		vector<ID> contestIDs;
 		{
 			odb::transaction t(db::begin());
-			submission = db::load<Submission>(submissionID);
-			submission->status = SubmissionStatus::JUDGING;
-			db::update(submission);
+			typedef odb::query<Contest> query;
+			odb::result<Contest> result = db::query<Contest>(query::active == true &&
+				query::beginTime <= now + PREFETCH_LEAD_TIME && query::endTime > now);
+			for(const Contest& contest: result) {
+				contestIDs.push_back(contest.id);
+			}
 			t.commit();
 		}
-		try {
-			compileProgram(submission, submission->program, *connection);
-		} catch(const ::apache::thrift::TException&) {
-			odb::transaction t(db::begin());
-			submission->status = SubmissionStatus::ERROR;
-			db::update(submission);
-			t.commit();
-			throw;
+		std::map<ID, std::set<string>> current;
+		std::set<string> hostNames = JudgeMaster::instance().connectedHostNames();
+		for(ID contestID: contestIDs) {
+			std::set<string>& done = current[contestID];
+			// Hosts not connected now dropped their prefetch tasks, so they
+			// are prefetched again once connected.
+			for(const string& hostName: prefetchedHosts[contestID]) {
+				if (hostNames.count(hostName)) done.insert(hostName);
+			}
+			std::set<string> newHosts;
+			for(const string& hostName: hostNames) {
+				if (done.insert(hostName).second) newHosts.insert(hostName);
+			}
+			if (newHosts.empty()) continue;
+			cerr<<"prefetching contest "<<contestID<<" to "<<newHosts.size()<<" hosts\n";
+			prefetchFiles(contestFiles(contestID), newHosts);
 		}
-		if (submission->program.binary) {
-			startTestGroups(submission);
-		} else {
+		prefetchedHosts.swap(current);
+	} catch(const std::exception& e) {
+		cerr<<"Checking upcoming contests failed: "<<e.what()<<'\n';
+	}
+	JudgeMaster::instance().schedule(CONTEST_CHECK_INTERVAL, checkUpcomingContests);
+}
+
+class CompileAndRunTask: public CompilingTask {
+public:
+	CompileAndRunTask(ID submissionID): submissionID(submissionID) {
+	}
+
+protected:
+	void run() override {
+		Cancellations::instance().forget(submissionID);
+		{
 			odb::transaction t(db::begin());
-			submission->status = SubmissionStatus::COMPILE_ERROR;
+			submission = db::load<Submission>(submissionID);
+			submission->status = SubmissionStatus::JUDGING;
 			db::update(submission);
 			t.commit();
 		}
+		compileProgram(submission, submission->program, [this]() {
+			if (submission->program.binary) {
+				startTestGroups(submission);
+			} else {
+				odb::transaction t(db::begin());
+				submission->status = SubmissionStatus::COMPILE_ERROR;
+				db::update(submission);
+				t.commit();
+			}
+		});
+	}
+
+	void onFailure(const ::apache::thrift::TException* e) override {
+		if (!e || !submission || willRetry(*e)) return;
+		odb::transaction t(db::begin());
+		submission->status = SubmissionStatus::ERROR;
+		db::update(submission);
+		t.commit();
+	}
+
+	optional<PendingJudgeTask> queueEntry() override {
+		PendingJudgeTask entry;
+		entry.type = JudgeTaskType::COMPILE_AND_RUN;
+		entry.target = submissionID;
+		return entry;
 	}
 
 private:
 	ID submissionID;
+	SubmissionPtr submission;
 
 	void startTestGroups(SubmissionPtr submission) {
 		TaskPtr task = submission->task;
+		vector<RunTestGroup*> groupTasks;
 		{
+			// Replace this task by the group tasks in the database queue
+			// atomically.
 			odb::transaction t(db::begin());
 			db::load(*task, task->sec);
-			submission->missingResults = task->testGroups.size();
+			for(auto group: task->testGroups) {
+				int testCount = group->tests.size();
+				int first = 0;
+				do {
+					RunTestGroup* groupTask = new RunTestGroup(
+						submission->id, group->id, first, RunTestGroup::SHARD_SIZE);
+					groupTask->priority = priority;
+					groupTask->userID = userID;
+					groupTask->listFiles(*submission, *group);
+					groupTasks.push_back(groupTask);
+					first += RunTestGroup::SHARD_SIZE;
+				} while(first < testCount);
+			}
+			submission->missingResults = groupTasks.size();
 			db::update(submission);
+			for(RunTestGroup* groupTask: groupTasks) {
+				groupTask->persistQueueEntry();
+			}
+			if (queueEntryID) eraseQueueEntry();
 			t.commit();
 		}
-		for(auto group: task->testGroups) {
-			master->addTask(new RunTestGroup(submission, group));
+		// Each shard is placed on the host that has most of its data. The
+		// binary is on the host that compiled it, but large inputs may
+		// outweigh it.
+		for(RunTestGroup* groupTask: groupTasks) {
+			master->addTask(groupTask);
 		}
 	}
 };
@@ -507,12 +2123,50 @@ private:
 
 namespace cses {
 
-void addForJudging(SubmissionPtr submission) {
+void addForJudging(SubmissionPtr submission, bool rejudge) {
 	cerr<<"adding task for judging\n";
-	CompileAndRunTask* task = new CompileAndRunTask(submission);
+	TaskPriority priority = TaskPriority::PRACTICE;
+	ContestPtr contest = submission->task->contest.lock();
+	if (rejudge) {
+		priority = TaskPriority::REJUDGE;
+	} else if (contest && contest->isRunning()) {
+		priority = TaskPriority::LIVE_CONTEST;
+	}
+	CompileAndRunTask* task = new CompileAndRunTask(submission->id);
+	task->priority = priority;
+	task->userID = submission->user->id;
 	JudgeMaster::instance().addTask(task);
 }
 
+void rejudgeTask(TaskPtr task) {
+	odb::session session;
+	vector<SubmissionPtr> submissions;
+	{
+		odb::transaction t(db::begin());
+		typedef odb::query<Submission> query;
+		odb::result<Submission> result = db::query<Submission>(query::task == task->id);
+		for(auto it = result.begin(); it != result.end(); ++it) {
+			SubmissionPtr submission = it.load();
+			// Results of a submission still being judged would be mixed
+			// with the new ones.
+			if (submission->status == SubmissionStatus::PENDING ||
+				submission->status == SubmissionStatus::JUDGING) continue;
+			submissions.push_back(submission);
+		}
+		for(SubmissionPtr submission: submissions) {
+			submission->status = SubmissionStatus::PENDING;
+			submission->score = 0;
+			db::update(submission);
+			db::eraseQuery<Result>(odb::query<Result>::submission == submission->id);
+		}
+		t.commit();
+	}
+	cerr<<"rejudging "<<submissions.size()<<" submissions of task "<<task->id<<'\n';
+	for(SubmissionPtr submission: submissions) {
+		addForJudging(submission, true);
+	}
+}
+
 void updateJudgeHosts() {
 	JudgeMaster::instance().updateJudgeHosts();
 }
@@ -521,4 +2175,61 @@ void compileEvaluator(TaskPtr task) {
 	JudgeMaster::instance().addTask(new CompileEvaluatorTask(task->id));
 }
 
+void prefetchContest(ID contestID) {
+	prefetchFiles(contestFiles(contestID), JudgeMaster::instance().connectedHostNames());
+}
+
+void enableHedging() {
+	hedgingEnabled = true;
+}
+
+void startPrefetching() {
+	JudgeMaster::instance().schedule(std::chrono::milliseconds(0), checkUpcomingContests);
+}
+
+void resumeJudging() {
+	vector<PendingJudgeTask> entries;
+	{
+		odb::transaction t(db::begin());
+		odb::result<PendingJudgeTask> result = db::query<PendingJudgeTask>();
+		entries.assign(result.begin(), result.end());
+	}
+	cerr<<"resuming "<<entries.size()<<" judging tasks\n";
+	odb::session session;
+	for(const PendingJudgeTask& entry: entries) {
+		UnitTask* task = nullptr;
+		switch(entry.type) {
+			case JudgeTaskType::COMPILE_AND_RUN:
+				task = new CompileAndRunTask(entry.target);
+				break;
+			case JudgeTaskType::RUN_TEST_GROUP:
+				{
+					RunTestGroup* groupTask = new RunTestGroup(
+						entry.target, entry.testGroup, entry.firstTest, entry.testCount);
+					// Files are listed again, so that the shard is placed on
+					// a host that has them as before the restart.
+					try {
+						odb::transaction t(db::begin());
+						groupTask->listFiles(
+							*db::load<Submission>(entry.target),
+							*db::load<TestGroup>(entry.testGroup));
+						t.commit();
+					} catch(const std::exception& e) {
+						cerr<<"Listing files of resumed task failed: "<<e.what()<<'\n';
+					}
+					task = groupTask;
+				}
+				break;
+			case JudgeTaskType::COMPILE_EVALUATOR:
+				task = new CompileEvaluatorTask(entry.target);
+				break;
+		}
+		if (!task) continue;
+		task->priority = TaskPriority(entry.priority);
+		task->userID = entry.user;
+		task->queueEntryID = entry.id;
+		JudgeMaster::instance().addTask(task);
+	}
+}
+
 }
@@ -3,8 +3,25 @@
 
 namespace cses {
 
-void addForJudging(SubmissionPtr submission);
+// Queue submission for judging. Rejudged submissions are judged after new
+// ones, and submissions to running contests before others.
+void addForJudging(SubmissionPtr submission, bool rejudge = false);
+// Judge the finished submissions to the task again. Their old results and
+// scores are removed first.
+void rejudgeTask(TaskPtr task);
 void updateJudgeHosts();
 void compileEvaluator(TaskPtr task);
 
+// Queue judging tasks left unfinished by an earlier run of the server.
+void resumeJudging();
+
+// Upload test data of the contest to all connected judge hosts in the
+// background.
+void prefetchContest(ID contestID);
+// Periodically prefetch contests that are about to begin.
+void startPrefetching();
+// Run a copy of a test shard on another host when it takes longer than 99%
+// of recent shards relative to the time limit.
+void enableHedging();
+
 }
@@ -5,6 +5,7 @@
 #include "file.hpp"
 #include "judging.hpp"
 #include "import.hpp"
+#include "gc.hpp"
 #include <booster/log.h>
 #include <cppcms/application.h>
 #include <cppcms/applications_pool.h>
@@ -28,6 +29,9 @@ struct Server: cppcms::application {
 		dispatcher().assign("/task/(\\d+)/", &Server::wrap<&Server::editTask>, this, 1);
 		mapper().assign("task", "task/{1}/");
 
+		dispatcher().assign("/rejudge/(\\d+)/", &Server::wrap<&Server::rejudge>, this, 1);
+		mapper().assign("rejudge", "rejudge/{1}/");
+
 		dispatcher().assign("/submit/(\\d+)/", &Server::wrap<&Server::submit>, this, 1);
 		mapper().assign("submit", "submit/{1}/");
 
@@ -170,6 +174,16 @@ struct Server: cppcms::application {
 		render("task", t);
 	}
 
+	void rejudge(string id) {
+		getRequiredAdminUser();
+		
+		auto task = getByStringOrFail<Task>(id);
+		if (isPost()) {
+			rejudgeTask(task);
+		}
+		sendRedirectHeader("/task", id);
+	}
+
 	void listSubmissions(string id) {
 		UserPtr user = getRequiredUser();
 		
@@ -710,9 +724,14 @@ struct Server: cppcms::application {
 						}
 					}
 					newContest->tasks.push_back(newTask);
-					compileEvaluator(newTask);
+					// The default evaluator is compiled when the task is
+					// switched to use it.
+					if (newTask->checker == CheckerType::CUSTOM) {
+						compileEvaluator(newTask);
+					}
 				}
 				t.commit();
+				prefetchContest(newContest->id);
 				sendRedirectHeader("/contest", newContest->id);
 				return;
 			}
@@ -807,13 +826,26 @@ struct Server: cppcms::application {
 int main(int argc, char** argv) {
 	bool resetDB = 0;
 	bool connectToJudge = 0;
+	bool garbageCollect = 0;
 	for(int i=1; i<argc; ++i) {
 		string s = argv[i];
 		if (s=="-d") resetDB = 1;
 		else if (s=="-c") connectToJudge = 1;
+		else if (s=="-compress") setFileCompression(true);
+		else if (s=="-migrate-files") {
+			int moved = migrateFileStore();
+			cerr << "Moved " << moved << " files to the sharded layout.\n";
+			return 0;
+		}
+		else if (s=="-gc") garbageCollect = 1;
+		else if (s=="-hedge") enableHedging();
 		else cerr << "Unknown argument " << s << '\n';
 	}
 	db::init(resetDB);
+	if (garbageCollect) {
+		collectGarbage();
+		return 0;
+	}
 	std::ifstream configFile("config.js");
 	cppcms::json::value config;
 	int line=0;
@@ -824,6 +856,8 @@ int main(int argc, char** argv) {
 	}
 	if (connectToJudge) {
 		updateJudgeHosts();
+		resumeJudging();
+		startPrefetching();
 	}
 	cppcms::service srv(config);
 	srv.applications_pool().mount(cppcms::applications_factory<Server>());
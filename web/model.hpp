@@ -79,6 +79,16 @@ void update(shared_ptr<T> obj) {
 	return detail::database->update<T>(obj);
 }
 
+template <typename T>
+void erase(ID id) {
+	detail::database->erase<T>(id);
+}
+
+template <typename T>
+unsigned long long eraseQuery(const odb::query<T>& q) {
+	return detail::database->erase_query<T>(q);
+}
+
 }
 
 // Return ID of active user with given username and password, if exists.
@@ -174,6 +174,17 @@ struct Sandbox {
 	Sandbox(Type type): type(type) { }
 	Sandbox() { }
 	
+	// String that is equal for sandboxes with identical configuration.
+	string identity() const {
+		stringstream ss;
+		if(type == DOCKER) {
+			ss << "docker " << docker.repository << ' ' << docker.imageID;
+		} else {
+			ss << "ptrace " << ptrace.policy << ' ' << ptrace.allowedSyscalls << ' ' << ptrace.runner.hash;
+		}
+		return ss.str();
+	}
+	
 	void validate() {
 		if(type == DOCKER) {
 			docker.validate();
@@ -295,6 +306,15 @@ private:
 
 typedef shared_ptr<Contest> ContestPtr;
 
+// How outputs of submissions are compared to correct outputs. CUSTOM runs the
+// evaluator program, others are built into the judge.
+enum class CheckerType {
+	CUSTOM,
+	EXACT,
+	IGNORE_WHITESPACE,
+	FLOAT
+};
+
 #pragma db object
 struct Task: DBObject {
 	StrField name;
@@ -309,6 +329,15 @@ struct Task: DBObject {
 	double timeInSeconds = 1.0;
 	int64_t memoryInBytes = 64 * 1024 * 1024;
 	
+	CheckerType checker = CheckerType::IGNORE_WHITESPACE;
+	// Allowed differences of numbers with the FLOAT checker.
+	double absoluteEpsilon = 1e-9;
+	double relativeEpsilon = 1e-9;
+	
+	// Stop judging a submission after its first failed test, as in ICPC
+	// style contests where any failure rejects the submission.
+	bool stopOnFirstFailure = false;
+	
 #pragma db load(lazy) update(manual)
 	odb::section sec;
 	
@@ -328,6 +357,11 @@ struct Task: DBObject {
 		if(memoryInBytes <= 0) {
 			throw ValidationFailure("Memory limit must be positive.");
 		}
+		
+		if(!std::isfinite(absoluteEpsilon) || absoluteEpsilon < 0 ||
+		   !std::isfinite(relativeEpsilon) || relativeEpsilon < 0) {
+			throw ValidationFailure("Epsilons must be non-negative.");
+		}
 	}
 };
 typedef shared_ptr<Task> TaskPtr;
@@ -444,11 +478,171 @@ struct Result: DBObject {
 	int memoryInBytes = 0;
 };
 
+// Outcome of running a binary on an input, reused when the same binary is
+// run again on the same input, for example when rejudging.
+#pragma db object
+struct RunMemo: DBObject {
+	// Hash of runner sandbox identity, binary, input and memory limit.
+#pragma db unique
+	StrField key;
+	// Time limit of the memoized run.
+	double timeLimit = 0;
+	// CORRECT if the run succeeded, output is not yet evaluated.
+	ResultStatus status = ResultStatus::INTERNAL_ERROR;
+	MaybeFile output;
+	MaybeFile errOutput;
+	float timeInSeconds = 0;
+	int memoryInBytes = 0;
+	
+	// Whether running with the new time limit would give the same outcome.
+	bool reusableWith(double newTimeLimit) const {
+		if(status == ResultStatus::TIME_LIMIT) return newTimeLimit <= timeLimit;
+		return timeInSeconds < timeLimit && timeInSeconds <= newTimeLimit;
+	}
+	
+	void validate() {
+		output.validate();
+		errOutput.validate();
+	}
+};
+
+// Verdict of an evaluator for an output, reused when identical output is
+// evaluated again.
+#pragma db object
+struct EvaluationMemo: DBObject {
+	// Hash of evaluator sandbox identity, evaluator binary, output, correct
+	// output and input.
+#pragma db unique
+	StrField key;
+	ResultStatus status = ResultStatus::INTERNAL_ERROR;
+};
+
 #pragma db object
 struct JudgeHost: DBObject {
 	StrField name;
 	StrField host;
 	int port;
+	// Set to give the host no new tasks, for example for maintenance. Its
+	// running tasks are finished.
+	bool draining = false;
+};
+
+// Result of a successful compilation, reused when the same source is
+// compiled again with an identical compiler sandbox.
+#pragma db object
+struct CompileCacheEntry: DBObject {
+	// Source hash and hash of the compiler sandbox identity.
+#pragma db unique
+	StrField key;
+	MaybeFile binary;
+	string compileMessage;
+	
+	
+	void validate() {
+		binary.validate();
+	}
+};
+
+enum class JudgeTaskType {
+	COMPILE_AND_RUN,
+	RUN_TEST_GROUP,
+	COMPILE_EVALUATOR,
+};
+
+// Unfinished judging task, kept so that judging can continue after the
+// server is restarted.
+#pragma db object
+struct PendingJudgeTask: DBObject {
+	JudgeTaskType type = JudgeTaskType::COMPILE_AND_RUN;
+	// Submission, or task whose evaluator is compiled.
+	ID target = 0;
+	ID testGroup = 0;
+	// Shard of the test group, testCount 0 meaning all tests from firstTest.
+	int firstTest = 0;
+	int testCount = 0;
+	int priority = 0;
+	ID user = 0;
+};
+
+// Views of the file hashes referenced by each object type, used by the
+// garbage collector to find stored files that are still needed.
+
+#pragma db view object(TestCase)
+struct TestCaseFiles {
+#pragma db column(TestCase::input.hash)
+	string input;
+#pragma db column(TestCase::output.hash)
+	string output;
+	
+	vector<string> hashes() const { return {input, output}; }
+};
+
+#pragma db view object(Submission)
+struct SubmissionFiles {
+#pragma db column(Submission::program.source.hash)
+	string source;
+#pragma db column(Submission::program.binary.hash)
+	string binary;
+	
+	vector<string> hashes() const { return {source, binary}; }
+};
+
+#pragma db view object(Result)
+struct ResultFiles {
+#pragma db column(Result::output.hash)
+	string output;
+#pragma db column(Result::errOutput.hash)
+	string errOutput;
+	
+	vector<string> hashes() const { return {output, errOutput}; }
+};
+
+#pragma db view object(RunMemo)
+struct RunMemoFiles {
+#pragma db column(RunMemo::output.hash)
+	string output;
+#pragma db column(RunMemo::errOutput.hash)
+	string errOutput;
+	
+	vector<string> hashes() const { return {output, errOutput}; }
+};
+
+#pragma db view object(CompileCacheEntry)
+struct CompileCacheFiles {
+#pragma db column(CompileCacheEntry::binary.hash)
+	string binary;
+	
+	vector<string> hashes() const { return {binary}; }
+};
+
+#pragma db view object(Task)
+struct TaskFiles {
+#pragma db column(Task::evaluator.source.hash)
+	string source;
+#pragma db column(Task::evaluator.binary.hash)
+	string binary;
+	
+	vector<string> hashes() const { return {source, binary}; }
+};
+
+#pragma db view object(SubmissionLanguage)
+struct SubmissionLanguageFiles {
+#pragma db column(SubmissionLanguage::compiler.ptrace.runner.hash)
+	string compilerRunner;
+#pragma db column(SubmissionLanguage::runner.ptrace.runner.hash)
+	string runnerRunner;
+	
+	vector<string> hashes() const { return {compilerRunner, runnerRunner}; }
+};
+
+#pragma db view object(EvaluatorLanguage)
+struct EvaluatorLanguageFiles {
+#pragma db column(EvaluatorLanguage::compiler.ptrace.runner.hash)
+	string compilerRunner;
+#pragma db column(EvaluatorLanguage::runner.ptrace.runner.hash)
+	string runnerRunner;
+	
+	vector<string> hashes() const { return {compilerRunner, runnerRunner}; }
 };
 
 }